@@ -21,6 +21,12 @@
 #include <errno.h>
 #include <stdlib.h>
 
+// Running totals of the sizes requested and of the number of calls,
+// for reporting by -S.  The lexing threads allocate concurrently, so
+// these are updated atomically.
+static size_t total_bytes;
+static size_t total_count;
+
 static void
 memory_exhausted (int errnum)
 {
@@ -38,12 +44,16 @@ check_nonnull (void *p)
 void *
 checked_malloc (size_t size)
 {
+  __atomic_fetch_add (&total_bytes, size, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&total_count, 1, __ATOMIC_RELAXED);
   return check_nonnull (malloc (size ? size : 1));
 }
 
 void *
 checked_realloc (void *ptr, size_t size)
 {
+  __atomic_fetch_add (&total_bytes, size, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&total_count, 1, __ATOMIC_RELAXED);
   return check_nonnull (realloc (ptr, size ? size : 1));
 }
 
@@ -56,3 +66,15 @@ checked_grow_alloc (void *ptr, size_t *size)
   *size = *size < max / 2 ? 2 * *size : max;
   return checked_realloc (ptr, *size);
 }
+
+size_t
+allocation_bytes (void)
+{
+  return total_bytes;
+}
+
+size_t
+allocation_count (void)
+{
+  return total_count;
+}
@@ -3,3 +3,5 @@
 void *checked_malloc (size_t);
 void *checked_realloc (void *, size_t);
 void *checked_grow_alloc (void *, size_t *);
+size_t allocation_bytes (void);
+size_t allocation_count (void);
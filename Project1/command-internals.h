@@ -15,6 +15,8 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+#include <stddef.h>
+
 enum command_type
   {
     IF_COMMAND,		 // if A then B else C fi
@@ -31,6 +33,8 @@ struct command_stream
   struct command *command;
   struct command_stream *prev;
   struct command_stream *next;
+  struct command_stream *unread;	// In the first node: the first one
+					// not read yet, or NULL
   int is_read;
 };
 
@@ -70,6 +74,40 @@ struct token_stream
   struct token_stream *next;
 };
 
+// A top-level piece of the input buffer, [start, end), tokenized on its own.
+struct lex_chunk
+{
+  int start;
+  int end;
+  int line;                            // line number at start
+  struct token_stream *head;
+  struct token_stream *tail;
+  int error_line;                      // first bad line, or 0
+  size_t tokens[UNKNOWN_TOKEN + 1];
+  size_t words;
+  size_t word_bytes;
+};
+
+// Statistics gathered while making a command stream, for -S.
+struct parse_stats
+{
+  size_t bytes_read;
+  size_t tokens[UNKNOWN_TOKEN + 1];    // indexed by enum token_type
+  size_t commands[WHILE_COMMAND + 1];  // indexed by enum command_type
+  size_t words;                        // word tokens, and the bytes
+  size_t word_bytes;                   //   separate copies would take
+  size_t unique_words;                 // distinct words interned, and
+  size_t unique_bytes;                 //   the bytes they take
+  int max_token_depth;
+  int max_command_depth;
+
+  // Wall time, in seconds, spent in each phase of make_command_stream.
+  double read_time;
+  double tokenize_time;
+  double check_time;
+  double build_time;
+};
+
 // Data associated with a command.
 struct command
 {
@@ -27,6 +27,16 @@ typedef struct token_stream *token_stream_t;
    (setting errno) on failure.  */
 command_stream_t make_command_stream (int (*getbyte) (void *), void *arg);
 
+/* Create a command stream from the script open on FD.  A regular file
+   is mapped into memory and parsed in place; anything else is read
+   with large reads.  Exit with a message if FD cannot be read.  */
+command_stream_t make_command_stream_fd (int fd);
+
+/* Print to stderr the statistics gathered while STREAM was made:
+   bytes read, tokens and commands by type, peak stack depths,
+   storage allocated, and time spent in each parsing phase.  */
+void print_parse_stats (command_stream_t stream);
+
 /* Prepare for profiling to the file FILENAME.  If FILENAME is null or
    cannot be written to, set errno and return -1.  Otherwise, return a
    nonnegative integer flag useful as an argument to
@@ -40,8 +50,21 @@ command_t read_command_stream (command_stream_t stream);
 /* Print a command to stdout, for debugging.  */
 void print_command (command_t);
 
+/* Bound the child processes of this and every other profsh run by the
+   same user that calls this: this run starts a command only while at
+   most MAX_PROCS are alive at once, counting the command's own, and
+   while the load average is under MAX_LOAD, unless nothing else is
+   running.  So a command that alone needs more than MAX_PROCS processes
+   runs by itself.  Either limit may be 0 for none, and each run's
+   limits govern only its own commands.  The shared state is removed
+   when the last such run exits.  Without this call, commands start as
+   soon as they are reached.  */
+void set_spawn_limits (int max_procs, double max_load);
+
 /* Execute a command.  Use profiling according to the flag; do not profile
-   if the flag is negative.  */
+   if the flag is negative.  Each profiled command appends one line to
+   the profile: the time it finished, its real, user and system times,
+   the time it waited for the spawn limits, and the command itself.  */
 void execute_command (command_t, int);
 
 /* Return the exit status of a command, which must have previously
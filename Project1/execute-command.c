@@ -17,20 +17,350 @@
 
 #include "command.h"
 #include "command-internals.h"
+#include "alloc.h"
 
+#include <errno.h>
 #include <error.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
-/* FIXME: You may need to add #include directives, macro definitions,
-   static function definitions, etc.  */
+/* The spawn pool bounds how many child processes are alive at once,
+   across every profsh run by the same user that asked for a bound.
+   It lives in shared memory.  Each top-level command is a job that
+   must be admitted before it runs; its weight is the number of
+   processes it can have running at the same time.  Each job is
+   admitted under the limits of the run that queued it, and a job
+   wider than its MAX_PROCS waits until nothing else holds the pool
+   and then runs alone.  Jobs are admitted strictly in the order they
+   queued, and since each profsh queues at most one job at a time,
+   scripts take turns.  Processes inside an admitted job are never
+   queued again, so a job cannot wait on itself.  Entries of processes
+   that died are reclaimed by whoever next times out waiting.  The last
+   run to detach from the pool unlinks it; a run that finds the pool
+   it opened already unlinked opens a new one.  */
+
+enum { POOL_ENTRIES = 128 };
+
+struct pool_entry
+{
+  pid_t pid;			// 0 if the entry is free
+  unsigned ticket;
+  int weight;
+  int max_procs;		// 0 for no limit
+  double max_load;		// 0 for no limit
+};
+
+struct spawn_pool
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int initialized;
+  int unlinked;			// Detached by its last user; see above
+  int running;
+  unsigned next_ticket;
+  pid_t users[POOL_ENTRIES];	// The profsh runs attached, 0 if free
+  struct pool_entry waiting[POOL_ENTRIES];
+  struct pool_entry holding[POOL_ENTRIES];
+};
+
+static struct spawn_pool *pool;
+static char pool_name[64];
+static pid_t pool_user;		// The profsh that attached, not its children
+static int pool_max_procs;
+static double pool_max_load;
+
+// How often a queued job rechecks the load average and dead entries.
+#define POOL_POLL_NSEC 100000000
+
+static void
+lock_pool (void)
+{
+  if (pthread_mutex_lock (&pool->lock) == EOWNERDEAD)
+    pthread_mutex_consistent (&pool->lock);
+}
+
+/* Return true if process PID no longer exists.  */
+static int
+dead (pid_t pid)
+{
+  return kill (pid, 0) != 0 && errno == ESRCH;
+}
+
+/* Detach from the pool when this profsh exits, unlinking it if no other
+   run is attached.  A run killed before it can detach is forgotten by
+   the next one that does.  */
+static void
+detach_pool (void)
+{
+  if (getpid () != pool_user)
+    return;
+  lock_pool ();
+  int i, users = 0;
+  for (i = 0; i < POOL_ENTRIES; i++)
+    if (pool->users[i] == pool_user || (pool->users[i] && dead (pool->users[i])))
+      pool->users[i] = 0;
+    else if (pool->users[i])
+      users++;
+  if (! users)
+    {
+      shm_unlink (pool_name);
+      pool->unlinked = 1;
+    }
+  pthread_mutex_unlock (&pool->lock);
+  munmap (pool, sizeof *pool);
+  pool = NULL;
+}
+
+/* Open the pool, creating it if need be, and attach to it.  Return false
+   if it was unlinked meanwhile.  */
+static int
+attach_pool (void)
+{
+  int fd = shm_open (pool_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  int created = 0 <= fd;
+  if (! created)
+    fd = shm_open (pool_name, O_RDWR, 0600);
+  if (fd < 0 && errno == ENOENT)
+    return 0;
+  if (fd < 0 || (created && ftruncate (fd, sizeof *pool) != 0))
+    error (1, errno, "%s: cannot open spawn pool", pool_name);
+  pool = mmap (NULL, sizeof *pool, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (pool == MAP_FAILED)
+    error (1, errno, "%s: cannot map spawn pool", pool_name);
+  close (fd);
+
+  if (created)
+    {
+      pthread_mutexattr_t ma;
+      pthread_mutexattr_init (&ma);
+      pthread_mutexattr_setpshared (&ma, PTHREAD_PROCESS_SHARED);
+      pthread_mutexattr_setrobust (&ma, PTHREAD_MUTEX_ROBUST);
+      pthread_mutex_init (&pool->lock, &ma);
+      pthread_condattr_t ca;
+      pthread_condattr_init (&ca);
+      pthread_condattr_setpshared (&ca, PTHREAD_PROCESS_SHARED);
+      pthread_cond_init (&pool->cond, &ca);
+      __atomic_store_n (&pool->initialized, 1, __ATOMIC_RELEASE);
+    }
+  else
+    while (! __atomic_load_n (&pool->initialized, __ATOMIC_ACQUIRE))
+      usleep (1000);
+
+  lock_pool ();
+  int i, attached = 0;
+  if (! pool->unlinked)
+    for (i = 0; i < POOL_ENTRIES && ! attached; i++)
+      if (! pool->users[i] || dead (pool->users[i]))
+	{
+	  pool->users[i] = getpid ();
+	  attached = 1;
+	}
+  pthread_mutex_unlock (&pool->lock);
+  if (attached)
+    return 1;
+  if (! pool->unlinked)
+    error (1, 0, "%s: too many runs share the spawn pool", pool_name);
+  munmap (pool, sizeof *pool);
+  pool = NULL;
+  return 0;
+}
+
+void
+set_spawn_limits (int max_procs, double max_load)
+{
+  sprintf (pool_name, "/profsh-pool-%d", (int) getuid ());
+  while (! attach_pool ())
+    continue;
+  pool_user = getpid ();
+  atexit (detach_pool);
+
+  // Each run's limits apply to its own jobs only.
+  pool_max_procs = max_procs;
+  pool_max_load = max_load;
+}
+
+/* Free the entries of processes that no longer exist.  */
+static void
+reap_pool_entries (void)
+{
+  int i;
+  for (i = 0; i < POOL_ENTRIES; i++)
+    {
+      if (pool->waiting[i].pid && dead (pool->waiting[i].pid))
+	pool->waiting[i].pid = 0;
+      if (pool->holding[i].pid && dead (pool->holding[i].pid))
+	{
+	  pool->running -= pool->holding[i].weight;
+	  pool->holding[i].pid = 0;
+	}
+    }
+}
+
+static struct pool_entry *
+free_entry (struct pool_entry *e)
+{
+  int i;
+  for (i = 0; i < POOL_ENTRIES; i++)
+    if (! e[i].pid)
+      return &e[i];
+  return NULL;
+}
+
+/* Return true if the queued entry W may start now, under its own
+   limits.  A job wider than its MAX_PROCS may start only alone.  */
+static int
+may_start (struct pool_entry *w)
+{
+  int i;
+  for (i = 0; i < POOL_ENTRIES; i++)
+    if (pool->waiting[i].pid
+	&& (int) (pool->waiting[i].ticket - w->ticket) < 0)
+      return 0;
+  if (w->max_procs && pool->running
+      && w->max_procs < pool->running + w->weight)
+    return 0;
+  if (w->max_load && pool->running)
+    {
+      double load;
+      if (getloadavg (&load, 1) == 1 && w->max_load <= load)
+	return 0;
+    }
+  return 1;
+}
+
+static void
+pool_wait (void)
+{
+  struct timespec deadline;
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += POOL_POLL_NSEC;
+  if (1000000000 <= deadline.tv_nsec)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  int r = pthread_cond_timedwait (&pool->cond, &pool->lock, &deadline);
+  if (r == EOWNERDEAD)
+    pthread_mutex_consistent (&pool->lock);
+  if (r == ETIMEDOUT)
+    reap_pool_entries ();
+}
+
+/* Queue for WEIGHT slots of the pool and return once they are granted,
+   or at once if there is no pool.  */
+static void
+acquire_slots (int weight)
+{
+  if (! pool)
+    return;
+  lock_pool ();
+  struct pool_entry *w;
+  while (! (w = free_entry (pool->waiting)))
+    pool_wait ();
+  w->pid = getpid ();
+  w->ticket = pool->next_ticket++;
+  w->weight = weight;
+  w->max_procs = pool_max_procs;
+  w->max_load = pool_max_load;
+  struct pool_entry *h;
+  while (! may_start (w) || ! (h = free_entry (pool->holding)))
+    pool_wait ();
+  *h = *w;
+  w->pid = 0;
+  pool->running += weight;
+  pthread_cond_broadcast (&pool->cond);
+  pthread_mutex_unlock (&pool->lock);
+}
+
+/* Give back the slots granted to this process.  */
+static void
+release_slots (void)
+{
+  if (! pool)
+    return;
+  pid_t pid = getpid ();
+  lock_pool ();
+  int i;
+  for (i = 0; i < POOL_ENTRIES; i++)
+    if (pool->holding[i].pid == pid)
+      {
+	pool->running -= pool->holding[i].weight;
+	pool->holding[i].pid = 0;
+      }
+  pthread_cond_broadcast (&pool->cond);
+  pthread_mutex_unlock (&pool->lock);
+}
+
+static int command_width (command_t);
+static int spawned_width (command_t);
+
+/* Return the number of processes the compound command C can have
+   running at once, its redirections aside.  */
+static int
+body_width (command_t c)
+{
+  int a, b;
+  switch (c->type)
+    {
+    case PIPE_COMMAND:
+      return spawned_width (c->u.command[0]) + spawned_width (c->u.command[1]);
+    case IF_COMMAND:
+      a = command_width (c->u.command[0]);
+      b = command_width (c->u.command[1]);
+      if (a < b)
+	a = b;
+      if (c->u.command[2] && a < (b = command_width (c->u.command[2])))
+	a = b;
+      return a;
+    default:
+      a = command_width (c->u.command[0]);
+      b = command_width (c->u.command[1]);
+      return a < b ? b : a;
+    }
+}
+
+/* Return the number of processes C can have running at once when spawn
+   runs it in a child: the child itself, plus whatever that child runs.  */
+static int
+spawned_width (command_t c)
+{
+  if (c->type == SIMPLE_COMMAND)
+    return 1;
+  if (c->type == SUBSHELL_COMMAND)
+    return 1 + command_width (c->u.command[0]);
+  return 1 + body_width (c);
+}
+
+/* Return the number of processes C can have running at once when
+   execute runs it.  */
+static int
+command_width (command_t c)
+{
+  if (c->type == SIMPLE_COMMAND || c->type == SUBSHELL_COMMAND
+      || c->input || c->output)
+    return spawned_width (c);
+  return body_width (c);
+}
 
 int
 prepare_profiling (char const *name)
 {
-  /* FIXME: Replace this with your implementation.  You may need to
-     add auxiliary functions and otherwise modify the source code.
-     You can also use external functions defined in the GNU C Library.  */
-  error (0, 0, "warning: profiling not yet implemented");
-  return -1;
+  if (! name)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  return open (name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
 }
 
 int
@@ -39,9 +369,272 @@ command_status (command_t c)
   return c->status;
 }
 
+/* Redirect standard input and output as C asks.  Called in a child,
+   so failure is reported by exiting.  */
+static void
+redirect (command_t c)
+{
+  int fd;
+  if (c->input)
+    {
+      if ((fd = open (c->input, O_RDONLY)) < 0)
+	error (1, errno, "%s", c->input);
+      dup2 (fd, STDIN_FILENO);
+      close (fd);
+    }
+  if (c->output)
+    {
+      if ((fd = open (c->output, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+	error (1, errno, "%s", c->output);
+      dup2 (fd, STDOUT_FILENO);
+      close (fd);
+    }
+}
+
+static int
+wait_status (pid_t pid)
+{
+  int status;
+  while (waitpid (pid, &status, 0) < 0)
+    if (errno != EINTR)
+      error (1, errno, "waitpid");
+  return WIFEXITED (status) ? WEXITSTATUS (status) : 128 + WTERMSIG (status);
+}
+
+static void execute (command_t);
+
+/* Run C in a child process and return its pid.  Before running C, the
+   child closes UNUSED and makes IN its standard input and OUT its
+   standard output, each unless negative.  */
+static pid_t
+spawn (command_t c, int in, int out, int unused)
+{
+  pid_t pid = fork ();
+  if (pid < 0)
+    error (1, errno, "fork");
+  if (pid == 0)
+    {
+      if (0 <= unused)
+	close (unused);
+      if (0 <= in)
+	{
+	  dup2 (in, STDIN_FILENO);
+	  close (in);
+	}
+      if (0 <= out)
+	{
+	  dup2 (out, STDOUT_FILENO);
+	  close (out);
+	}
+      redirect (c);
+      if (c->type == SUBSHELL_COMMAND)
+	{
+	  execute (c->u.command[0]);
+	  exit (c->u.command[0]->status);
+	}
+      if (c->type != SIMPLE_COMMAND)
+	{
+	  // The redirections are done, so run C itself in this child.
+	  c->input = c->output = NULL;
+	  execute (c);
+	  exit (c->status);
+	}
+      if (strcmp (c->u.word[0], ":") == 0)
+	exit (0);
+      execvp (c->u.word[0], c->u.word);
+      error (0, errno, "%s", c->u.word[0]);
+      _exit (127);
+    }
+  return pid;
+}
+
+/* Execute C, setting c->status.  */
+static void
+execute (command_t c)
+{
+  if (c->type == SIMPLE_COMMAND || c->type == SUBSHELL_COMMAND
+      || c->input || c->output)
+    {
+      c->status = wait_status (spawn (c, -1, -1, -1));
+      return;
+    }
+
+  command_t *sub = c->u.command;
+  switch (c->type)
+    {
+    case SEQUENCE_COMMAND:
+      execute (sub[0]);
+      execute (sub[1]);
+      c->status = sub[1]->status;
+      break;
+
+    case PIPE_COMMAND:
+      {
+	int fd[2];
+	if (pipe (fd) != 0)
+	  error (1, errno, "pipe");
+	pid_t left = spawn (sub[0], -1, fd[1], fd[0]);
+	close (fd[1]);
+	pid_t right = spawn (sub[1], fd[0], -1, -1);
+	close (fd[0]);
+	sub[0]->status = wait_status (left);
+	c->status = sub[1]->status = wait_status (right);
+	break;
+      }
+
+    case IF_COMMAND:
+      execute (sub[0]);
+      if (sub[0]->status == 0)
+	{
+	  execute (sub[1]);
+	  c->status = sub[1]->status;
+	}
+      else if (sub[2])
+	{
+	  execute (sub[2]);
+	  c->status = sub[2]->status;
+	}
+      else
+	c->status = 0;
+      break;
+
+    case WHILE_COMMAND:
+    case UNTIL_COMMAND:
+      c->status = 0;
+      for (;;)
+	{
+	  execute (sub[0]);
+	  if ((sub[0]->status == 0) != (c->type == WHILE_COMMAND))
+	    break;
+	  execute (sub[1]);
+	  c->status = sub[1]->status;
+	}
+      break;
+
+    default:
+      abort ();
+    }
+}
+
+/* Append the string S to the buffer *BUF of size *SIZE holding *LEN
+   bytes, keeping it null-terminated.  */
+static void
+append_string (char **buf, size_t *len, size_t *size, char const *s)
+{
+  size_t n = strlen (s);
+  while (*size <= *len + n)
+    *buf = checked_grow_alloc (*buf, size);
+  memcpy (*buf + *len, s, n + 1);
+  *len += n;
+}
+
+/* Append C to the buffer, written on one line.  */
+static void
+append_command (char **buf, size_t *len, size_t *size, command_t c)
+{
+  int i;
+  switch (c->type)
+    {
+    case SIMPLE_COMMAND:
+      for (i = 0; c->u.word[i]; i++)
+	{
+	  if (i)
+	    append_string (buf, len, size, " ");
+	  append_string (buf, len, size, c->u.word[i]);
+	}
+      break;
+    case SEQUENCE_COMMAND:
+    case PIPE_COMMAND:
+      append_command (buf, len, size, c->u.command[0]);
+      append_string (buf, len, size,
+		     c->type == SEQUENCE_COMMAND ? " ; " : " | ");
+      append_command (buf, len, size, c->u.command[1]);
+      break;
+    case SUBSHELL_COMMAND:
+      append_string (buf, len, size, "( ");
+      append_command (buf, len, size, c->u.command[0]);
+      append_string (buf, len, size, " )");
+      break;
+    case IF_COMMAND:
+      append_string (buf, len, size, "if ");
+      append_command (buf, len, size, c->u.command[0]);
+      append_string (buf, len, size, " ; then ");
+      append_command (buf, len, size, c->u.command[1]);
+      if (c->u.command[2])
+	{
+	  append_string (buf, len, size, " ; else ");
+	  append_command (buf, len, size, c->u.command[2]);
+	}
+      append_string (buf, len, size, " ; fi");
+      break;
+    default:
+      append_string (buf, len, size,
+		     c->type == WHILE_COMMAND ? "while " : "until ");
+      append_command (buf, len, size, c->u.command[0]);
+      append_string (buf, len, size, " ; do ");
+      append_command (buf, len, size, c->u.command[1]);
+      append_string (buf, len, size, " ; done");
+      break;
+    }
+  if (c->input)
+    {
+      append_string (buf, len, size, "<");
+      append_string (buf, len, size, c->input);
+    }
+  if (c->output)
+    {
+      append_string (buf, len, size, ">");
+      append_string (buf, len, size, c->output);
+    }
+}
+
+static double
+timespec_seconds (struct timespec t)
+{
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static double
+timeval_seconds (struct timeval t)
+{
+  return t.tv_sec + t.tv_usec / 1e6;
+}
+
 void
 execute_command (command_t c, int profiling)
 {
-  /* FIXME: Replace this with your implementation, like 'prepare_profiling'.  */
-  error (1, 0, "command execution not yet implemented");
+  struct timespec queued, started, finished, now;
+  struct rusage before, after;
+  clock_gettime (CLOCK_MONOTONIC, &queued);
+  acquire_slots (command_width (c));
+  clock_gettime (CLOCK_MONOTONIC, &started);
+  getrusage (RUSAGE_CHILDREN, &before);
+  execute (c);
+  getrusage (RUSAGE_CHILDREN, &after);
+  clock_gettime (CLOCK_MONOTONIC, &finished);
+  release_slots ();
+
+  if (profiling < 0)
+    return;
+  clock_gettime (CLOCK_REALTIME, &now);
+  size_t size = 256, len;
+  char *line = checked_malloc (size);
+  len = snprintf (line, size, "%.6f %.6f %.6f %.6f %.6f ",
+		  timespec_seconds (now),
+		  (timespec_seconds (finished)
+		   - timespec_seconds (started)),
+		  (timeval_seconds (after.ru_utime)
+		   - timeval_seconds (before.ru_utime)),
+		  (timeval_seconds (after.ru_stime)
+		   - timeval_seconds (before.ru_stime)),
+		  timespec_seconds (started) - timespec_seconds (queued));
+  append_command (&line, &len, &size, c);
+  while (size <= len + 1)
+    line = checked_grow_alloc (line, &size);
+  line[len++] = '\n';
+
+  // One write per line, so lines from concurrent runs do not interleave.
+  if (write (profiling, line, len) != (ssize_t) len)
+    error (0, errno, "cannot write profile");
+  free (line);
 }
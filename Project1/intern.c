@@ -0,0 +1,158 @@
+// UCLA CS 111 Lab 1 string interning
+
+// Identical words share one immutable, null-terminated string, so words
+// from the same parse can be compared by pointer.  The table is split
+// into shards, each with its own lock, so that the lexing threads can
+// intern concurrently; a word's hash picks its shard.  Nothing is
+// copied: the string is the word's first occurrence in the script
+// buffer, which intern_terminate null-terminates in place once the
+// buffer has been lexed.
+
+#include "intern.h"
+#include "alloc.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum { SHARD_BITS = 6, NSHARDS = 1 << SHARD_BITS };
+
+struct intern_entry
+{
+  uint64_t hash;
+  size_t len;
+  char *str;
+};
+
+struct intern_shard
+{
+  pthread_mutex_t lock;
+  struct intern_entry *entry;	// open addressing; null str if empty
+  size_t size;			// number of slots, a power of 2
+  size_t count;
+  size_t bytes;
+};
+
+struct intern_table
+{
+  struct intern_shard shard[NSHARDS];
+};
+
+static uint64_t
+hash_word (char const *s, size_t len)
+{
+  // FNV-1a.
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for (i = 0; i < len; i++)
+    h = (h ^ (unsigned char) s[i]) * 1099511628211ULL;
+  return h;
+}
+
+static void
+init_shard (struct intern_shard *sh)
+{
+  pthread_mutex_init (&sh->lock, NULL);
+  sh->size = 64;
+  sh->entry = checked_malloc (sh->size * sizeof *sh->entry);
+  memset (sh->entry, 0, sh->size * sizeof *sh->entry);
+  sh->count = sh->bytes = 0;
+}
+
+struct intern_table *
+make_intern_table (void)
+{
+  struct intern_table *t = checked_malloc (sizeof *t);
+  int i;
+  for (i = 0; i < NSHARDS; i++)
+    init_shard (&t->shard[i]);
+  return t;
+}
+
+static void
+grow_shard (struct intern_shard *sh)
+{
+  size_t size = 2 * sh->size;
+  struct intern_entry *entry = checked_malloc (size * sizeof *entry);
+  memset (entry, 0, size * sizeof *entry);
+  size_t i;
+  for (i = 0; i < sh->size; i++)
+    if (sh->entry[i].str)
+      {
+	size_t j = sh->entry[i].hash & (size - 1);
+	while (entry[j].str)
+	  j = (j + 1) & (size - 1);
+	entry[j] = sh->entry[i];
+      }
+  free (sh->entry);
+  sh->entry = entry;
+  sh->size = size;
+}
+
+/* Return the interned string for the LEN bytes at S, which is S
+   itself if this is the first time they have been seen.  S must
+   stay valid for as long as the table's strings are used, and S[LEN]
+   must be a writable byte that is no longer needed by the time
+   intern_terminate is called.  */
+char *
+intern (struct intern_table *t, char *s, size_t len)
+{
+  uint64_t h = hash_word (s, len);
+  struct intern_shard *sh = &t->shard[h >> (64 - SHARD_BITS)];
+  pthread_mutex_lock (&sh->lock);
+  size_t j = h & (sh->size - 1);
+  for (; sh->entry[j].str; j = (j + 1) & (sh->size - 1))
+    if (sh->entry[j].hash == h && sh->entry[j].len == len
+	&& memcmp (sh->entry[j].str, s, len) == 0)
+      {
+	char *str = sh->entry[j].str;
+	pthread_mutex_unlock (&sh->lock);
+	return str;
+      }
+  char *str = s;
+  sh->entry[j].hash = h;
+  sh->entry[j].len = len;
+  sh->entry[j].str = str;
+  sh->count++;
+  sh->bytes += len + 1;
+  if (2 * sh->count > sh->size)
+    grow_shard (sh);
+  pthread_mutex_unlock (&sh->lock);
+  return str;
+}
+
+/* Null-terminate every string in T.  */
+void
+intern_terminate (struct intern_table *t)
+{
+  int i;
+  size_t j;
+  for (i = 0; i < NSHARDS; i++)
+    for (j = 0; j < t->shard[i].size; j++)
+      if (t->shard[i].entry[j].str)
+	t->shard[i].entry[j].str[t->shard[i].entry[j].len] = '\0';
+}
+
+/* Return the number of distinct words in T.  */
+size_t
+intern_count (struct intern_table *t)
+{
+  size_t n = 0;
+  int i;
+  for (i = 0; i < NSHARDS; i++)
+    n += t->shard[i].count;
+  return n;
+}
+
+/* Return the bytes taken by the distinct words in T, counting their
+   null terminators.  */
+size_t
+intern_bytes (struct intern_table *t)
+{
+  size_t n = 0;
+  int i;
+  for (i = 0; i < NSHARDS; i++)
+    n += t->shard[i].bytes;
+  return n;
+}
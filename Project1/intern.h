@@ -0,0 +1,8 @@
+// UCLA CS 111 Lab 1 string interning
+#include <stddef.h>
+struct intern_table;
+struct intern_table *make_intern_table (void);
+char *intern (struct intern_table *, char *, size_t);
+void intern_terminate (struct intern_table *);
+size_t intern_count (struct intern_table *);
+size_t intern_bytes (struct intern_table *);
@@ -17,9 +17,12 @@
 
 #include <errno.h>
 #include <error.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "command.h"
 
@@ -29,13 +32,31 @@ static char const *script_name;
 static void
 usage (void)
 {
-  error (1, 0, "usage: %s [-p PROF-FILE | -t] SCRIPT-FILE", program_name);
+  error (1, 0, "usage: %s [-p PROF-FILE | -t] [-j MAX-PROCS] [-l MAX-LOAD] [-S] SCRIPT-FILE", program_name);
 }
 
+/* Return the positive integer ARG of option -OPT, or exit.  */
 static int
-get_next_byte (void *stream)
+positive_int (char opt, char const *arg)
 {
-  return getc (stream);
+  char *end;
+  errno = 0;
+  long n = strtol (arg, &end, 10);
+  if (end == arg || *end || errno || n <= 0 || INT_MAX < n)
+    error (1, 0, "-%c %s: not a positive integer", opt, arg);
+  return n;
+}
+
+/* Return the positive number ARG of option -OPT, or exit.  */
+static double
+positive_double (char opt, char const *arg)
+{
+  char *end;
+  errno = 0;
+  double d = strtod (arg, &end);
+  if (end == arg || *end || errno || ! (0 < d))
+    error (1, 0, "-%c %s: not a positive number", opt, arg);
+  return d;
 }
 
 int
@@ -43,14 +64,20 @@ main (int argc, char **argv)
 {
   int command_number = 1;
   bool print_tree = false;
+  bool print_stats = false;
+  int max_procs = -1;
+  double max_load = -1;
   char const *profile_name = 0;
   program_name = argv[0];
 
   for (;;)
-    switch (getopt (argc, argv, "p:t"))
+    switch (getopt (argc, argv, "j:l:p:tS"))
       {
+      case 'j': max_procs = positive_int ('j', optarg); break;
+      case 'l': max_load = positive_double ('l', optarg); break;
       case 'p': profile_name = optarg; break;
       case 't': print_tree = true; break;
+      case 'S': print_stats = true; break;
       default: usage (); break;
       case -1: goto options_exhausted;
       }
@@ -61,11 +88,12 @@ main (int argc, char **argv)
     usage ();
 
   script_name = argv[optind];
-  FILE *script_stream = fopen (script_name, "r");
-  if (! script_stream)
+  int script_fd = open (script_name, O_RDONLY);
+  if (script_fd < 0)
     error (1, errno, "%s: cannot open", script_name);
-  command_stream_t command_stream =
-    make_command_stream (get_next_byte, script_stream);
+  command_stream_t command_stream = make_command_stream_fd (script_fd);
+  if (print_stats)
+    print_parse_stats (command_stream);
   int profiling = -1;
   if (profile_name)
     {
@@ -74,6 +102,9 @@ main (int argc, char **argv)
 	error (1, errno, "%s: cannot open", profile_name);
     }
 
+  if (! print_tree && (0 < max_procs || 0 < max_load))
+    set_spawn_limits (max_procs < 0 ? 0 : max_procs, max_load < 0 ? 0 : max_load);
+
   command_t last_command = NULL;
   command_t command;
   while ((command = read_command_stream (command_stream)))
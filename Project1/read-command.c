@@ -18,27 +18,50 @@
 #include "command.h"
 #include "command-internals.h"
 #include "alloc.h"
+#include "intern.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
 #include <error.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Buffers at least this long are tokenized in parallel, each thread getting about
+LEX_CHUNKS_PER_THREAD chunks so that uneven chunks still balance out. There is a
+thread per processor, or as many as the PROFSH_LEX_THREADS environment variable
+says, so that tests can take either path on any machine.						*/
+#define PARALLEL_LEX_MIN_BYTES (1 << 20)
+#define LEX_CHUNKS_PER_THREAD 4
 
 token_stream_t token_stack = NULL;     
 command_t *command_stack = NULL;      
+int token_depth = 0;
+struct parse_stats parse_stats;
+struct intern_table *word_table = NULL;
 
 /********************************************
 ** Declaration of useful helping functions **
 *********************************************/
 
 char* read_stream(int (*get_next_byte) (void *), void *get_next_byte_argument); 
+char* map_script(int fd, size_t *maplen);
+char* read_fd(int fd);
+command_stream_t parse_buffer(char *buffer, size_t maplen, struct timespec *start);
 token_stream_t tokenize(char *buffer); 
+void tokenize_chunk(char *buffer, struct lex_chunk *chunk);
+int split_chunks(char *buffer, int start, int len, int line, int target, struct lex_chunk **chunks);
 void check_tokens(token_stream_t tokenStream);
 int check_char(char ch);
 command_stream_t make_command_stream_helper(token_stream_t tokenStream);
 command_t new_command();
 command_t command_combine(command_t command1, command_t command2, token_stream_t tokenStream);
 command_stream_t stream_add(command_stream_t commandStream, command_stream_t item);
+double elapsed_since(struct timespec *start);
 
 /**********************************
 ** Main Function Implementations **
@@ -54,37 +77,75 @@ command_stream_t
 make_command_stream (int (*get_next_byte) (void *),
 		     void *get_next_byte_argument)
 {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
   char *buffer = read_stream(get_next_byte, get_next_byte_argument);
+  return parse_buffer(buffer, 0, &start);
+}
+
+/* make_command_stream_fd() does the same as make_command_stream() but reads the script
+straight from a file descriptor. A regular file is mapped into memory and tokenized in
+place; anything else, such as a pipe, is read with large read() calls.				*/
+command_stream_t
+make_command_stream_fd (int fd)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  size_t maplen;
+  char *buffer = map_script(fd, &maplen);
+  if (buffer == NULL)
+    {
+      buffer = read_fd(fd);
+      maplen = 0;
+    }
+  return parse_buffer(buffer, maplen, &start);
+}
+
+/* parse_buffer() tokenizes, checks and builds the command stream from a buffer holding
+the whole script, timing each phase from START. Every word is interned in a string table
+made for this parse, whose strings are the words' first occurrences in the buffer, so
+the buffer is kept for as long as the command stream. If there is nothing to parse it
+is released: unmapped if MAPLEN is nonzero, freed otherwise.						*/
+command_stream_t
+parse_buffer (char *buffer, size_t maplen, struct timespec *start)
+{
+  parse_stats.read_time = elapsed_since(start);
   struct token_stream *tokenStream;
   struct command_stream *commandStream;
+  word_table = make_intern_table();
   tokenStream = tokenize(buffer);
+  parse_stats.tokenize_time = elapsed_since(start);
   if (tokenStream == NULL)
     { 
       fprintf(stderr, "%s\n", "Error in make_command_stream(): returning an empty token stream");
+      if (maplen)
+	munmap(buffer, maplen);
+      else
+	free(buffer);
       return NULL;
     }
+  intern_terminate(word_table);
   check_tokens(tokenStream);
+  parse_stats.check_time = elapsed_since(start);
   commandStream = make_command_stream_helper(tokenStream);
+  parse_stats.build_time = elapsed_since(start);
+  parse_stats.unique_words = intern_count(word_table);
+  parse_stats.unique_bytes = intern_bytes(word_table);
   return commandStream;
 }
 
-/* read_command_stream() looks at the current command stream and returns a pointer to 
-the current node in the linked list. Then it uses recursion to return the next pointer 
-in the stream and so on.																*/
+/* read_command_stream() returns the command of the first node in the stream that has
+not been read yet, and marks it read. The first node keeps track of it, so that reading
+a whole stream takes time linear, not quadratic, in its length.						*/
 command_t
 read_command_stream (command_stream_t s)
 {
-  if (s == NULL)
-    return NULL;
-  else if (s->is_read == 0) 
-    {
-      s->is_read = 1;	
-      return (s->command);
-    }
-  else if (s->next != NULL)
-    return read_command_stream(s->next);	
-  else
+  command_stream_t next;
+  if (s == NULL || (next = s->unread) == NULL)
     return NULL;
+  next->is_read = 1;
+  s->unread = next->next;
+  return next->command;
 }
 
 /**************************
@@ -110,6 +171,8 @@ void token_push(token_stream_t item)
 		token_stack->next = item;
 		token_stack = item;
 	}
+	if (++token_depth > parse_stats.max_token_depth)
+		parse_stats.max_token_depth = token_depth;
 }
 
 /* token_top() looks at the last item in the token stream linked list and returns its type */
@@ -128,6 +191,7 @@ token_stream_t token_pop()
 		return NULL;
 	token_stream_t top = token_stack;
 	token_stack = token_stack->prev;
+	token_depth--;
 	if (token_stack != NULL)
 		token_stack->next = NULL;
 	top->prev = top->next = NULL;
@@ -136,12 +200,15 @@ token_stream_t token_pop()
 
 /* command_push() sets the input item to the last item of the command "stack" array */
 void command_push(command_t item, int *top, size_t *size)	
+{
 	if (item == NULL)
 		return;
 	if (*size <= (*top + 1) * sizeof(command_t))
 		command_stack = (command_t *)checked_grow_alloc(command_stack, size);
 	(*top)++;
 	command_stack[*top] = item;
+	if (*top + 1 > parse_stats.max_command_depth)
+		parse_stats.max_command_depth = *top + 1;
 }
 
 /* command_pop() removes the last item of the command "stack" array */
@@ -244,27 +311,79 @@ char* read_stream(int (*get_next_byte) (void *),
   if (index == size - 1)
     buffer = (char *) checked_grow_alloc(buffer, &size);
   buffer[index] = '\0';
+  parse_stats.bytes_read = index;
   return buffer;
 }
 
-/* tokenize() goes through the char buffer and identifies each "token" or operator 
-and inserts them into a linked list that is the token stream						*/
-token_stream_t tokenize(char *buffer)
+/* map_script() maps a regular file privately into memory and returns it as the buffer,
+storing the length of the mapping in *MAPLEN, or returns NULL if FD is not a regular file
+or cannot be mapped. The buffer is followed by at least one zero byte: the file is mapped
+over an anonymous region one byte longer, so even a file that exactly fills its last page
+is terminated. Only the pages on which a distinct word first appears are written to,
+when the word is null-terminated, so only those are copied.							*/
+char* map_script(int fd, size_t *maplen)
 {
-  int index = 0;
-  int lineNumber = 1;
-  enum token_type type;
-  struct token_stream *head = NULL;
-  struct token_stream *curr = head;
-  if (buffer[index] == '\0') 
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
     return NULL;
-  while (buffer[index] == '\n')
+  size_t len = st.st_size;
+  size_t page = sysconf(_SC_PAGESIZE);
+  *maplen = (len + 1 + page - 1) / page * page;
+  char *buffer = mmap(NULL, *maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED)
+    return NULL;
+  if (mmap(buffer, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
     {
-      lineNumber++;
-      index++;
+      munmap(buffer, *maplen);
+      return NULL;
     }
-  char charIndex = buffer[index];
-  while (buffer[index] != '\0')
+  parse_stats.bytes_read = len;
+  return buffer;
+}
+
+/* read_fd() reads everything from FD into a char buffer with large read() calls, growing
+the buffer as needed, and returns it null-terminated								*/
+char* read_fd(int fd)
+{
+  size_t size = 1 << 16;
+  size_t index = 0;
+  char *buffer = (char *) checked_malloc(size);
+  for (;;)
+    {
+      if (index == size - 1)
+	buffer = (char *) checked_grow_alloc(buffer, &size);
+      ssize_t n = read(fd, buffer + index, size - 1 - index);
+      if (n == 0)
+	break;
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  error(1, errno, "cannot read script");
+	}
+      index += n;
+    }
+  buffer[index] = '\0';
+  parse_stats.bytes_read = index;
+  return buffer;
+}
+
+/* tokenize_chunk() goes through the bytes of the char buffer in [start, end) and identifies
+each "token" or operator, linking them into the chunk's own token list. Instead of exiting
+on a bad character it records the line in error_line, so that when chunks are lexed in
+parallel the error reported is still the first one in the file. Word tokens point to
+the word's interned string in word_table: its first occurrence in the buffer, which
+is null-terminated only once every chunk has been lexed.							*/
+void tokenize_chunk(char *buffer, struct lex_chunk *chunk)
+{
+  int index = chunk->start;
+  int end = chunk->end;
+  int lineNumber = chunk->line;
+  enum token_type type;
+  struct token_stream *head = NULL;
+  struct token_stream *curr = head;
+  char charIndex;
+  while (index < end)
     {
       charIndex = buffer[index];
       switch (charIndex)
@@ -301,10 +420,10 @@ token_stream_t tokenize(char *buffer)
 	    }
 	  break;
 	case '#':
-		if (index > 0 && check_char(buffer[index - 1]))
+		if (index > chunk->start && check_char(buffer[index - 1]))
 		{
-			print_error(lineNumber);
-			exit(1);
+			chunk->error_line = lineNumber;
+			break;
 		}
 		else
 		{
@@ -317,6 +436,8 @@ token_stream_t tokenize(char *buffer)
 	default:
 	  type = UNKNOWN_TOKEN; 
 	} 
+      if (chunk->error_line)
+	break;
       int lngth = 1;
       int temp = index;
       if (check_char(charIndex))	
@@ -326,6 +447,11 @@ token_stream_t tokenize(char *buffer)
 	    lngth++;
 	  index += lngth - 1;
 	}
+      else if (type == UNKNOWN_TOKEN)	
+	{
+	  chunk->error_line = lineNumber;
+	  break;
+	}
       struct token_stream *stream = (struct token_stream *) checked_malloc(sizeof(struct token_stream)); 
       stream->prev = NULL;
       stream->next = NULL;
@@ -337,36 +463,27 @@ token_stream_t tokenize(char *buffer)
 	stream->token.line_num = lineNumber;
       if (type == WORD_TOKEN)
 	{
-	  stream->token.word = (char *) checked_malloc(sizeof(char) * lngth + 1);
-	  int i = 0;
-	  while (i < lngth)
-	    {
-	      stream->token.word[i] = buffer[temp + i];
-	      i++;
-	    }
-	  stream->token.word[i] = '\0';
-	  if (strstr(stream->token.word, "if") != NULL && lngth == 2)
+	  stream->token.word = intern(word_table, buffer + temp, lngth);
+	  chunk->words++;
+	  chunk->word_bytes += lngth + 1;
+	  if (lngth == 2 && memcmp(stream->token.word, "if", 2) == 0)
 	    stream->token.type = IF_TOKEN;
-	  else if (strstr(stream->token.word, "then") != NULL && lngth == 4) 
+	  else if (lngth == 4 && memcmp(stream->token.word, "then", 4) == 0) 
 	    stream->token.type = THEN_TOKEN;
-	  else if (strstr(stream->token.word, "else") != NULL && lngth == 4) 
+	  else if (lngth == 4 && memcmp(stream->token.word, "else", 4) == 0) 
 	    stream->token.type = ELSE_TOKEN;
-	  else if (strstr(stream->token.word, "fi") != NULL && lngth == 2) 
+	  else if (lngth == 2 && memcmp(stream->token.word, "fi", 2) == 0) 
 	    stream->token.type = FI_TOKEN;
-	  else if (strstr(stream->token.word, "while") != NULL && lngth == 5) 
+	  else if (lngth == 5 && memcmp(stream->token.word, "while", 5) == 0) 
 	    stream->token.type = WHILE_TOKEN;
-	  else if (strstr(stream->token.word, "do") != NULL && lngth == 2) 
+	  else if (lngth == 2 && memcmp(stream->token.word, "do", 2) == 0) 
 	    stream->token.type = DO_TOKEN;
-	  else if (strstr(stream->token.word, "done") != NULL && lngth == 4) 
+	  else if (lngth == 4 && memcmp(stream->token.word, "done", 4) == 0) 
 	    stream->token.type = DONE_TOKEN;
-	  else if (strstr(stream->token.word, "until") != NULL && lngth == 5) 
+	  else if (lngth == 5 && memcmp(stream->token.word, "until", 5) == 0) 
 	    stream->token.type = UNTIL_TOKEN;
 	}
-      else if (type == UNKNOWN_TOKEN)	
-	{
-	  print_error(lineNumber);
-	  exit(1);
-	}
+      chunk->tokens[stream->token.type]++;
       if (curr == NULL)
 	{
 	  head = stream;
@@ -381,6 +498,212 @@ token_stream_t tokenize(char *buffer)
 	}
       index++;
     }
+  chunk->head = head;
+  chunk->tail = curr;
+}
+
+/* split_chunks() is a cheap pre-scan of the buffer from start that cuts it into chunks of
+roughly target bytes. A chunk only ends after a run of newlines that is at top level, i.e.
+not inside an open if/while/until or parenthesis and not inside a comment, so every chunk
+holds whole commands. The line number each chunk starts on is counted exactly as
+tokenize_chunk() counts it, so error lines do not depend on how the buffer was split.
+Returns the number of chunks stored in *chunks.									*/
+int split_chunks(char *buffer, int start, int len, int line, int target,
+		 struct lex_chunk **chunks)
+{
+  size_t size = 16 * sizeof(struct lex_chunk);
+  struct lex_chunk *chunk = (struct lex_chunk *) checked_malloc(size);
+  int n = 0;
+  int depth = 0;
+  int word = -1;
+  int in_comment = 0;
+  int chunk_start = start;
+  int index;
+  memset(&chunk[0], 0, sizeof(struct lex_chunk));
+  chunk[0].start = start;
+  chunk[0].line = line;
+  for (index = start; index < len; index++)
+    {
+      char ch = buffer[index];
+      if (in_comment)
+	{
+	  if (ch == '\n')
+	    in_comment = 0;
+	  continue;
+	}
+      if (check_char(ch))
+	{
+	  if (word < 0)
+	    word = index;
+	  continue;
+	}
+      if (word >= 0)
+	{
+	  int lngth = index - word;
+	  char *w = buffer + word;
+	  if ((lngth == 2 && memcmp(w, "if", 2) == 0)
+	      || (lngth == 5 && (memcmp(w, "while", 5) == 0 || memcmp(w, "until", 5) == 0)))
+	    depth++;
+	  else if ((lngth == 2 && memcmp(w, "fi", 2) == 0)
+		   || (lngth == 4 && memcmp(w, "done", 4) == 0))
+	    depth--;
+	  word = -1;
+	}
+      switch (ch)
+	{
+	case '(':
+	  depth++;
+	  break;
+	case ')':
+	  depth--;
+	  break;
+	case '#':
+	  in_comment = 1;
+	  break;
+	case '\n':
+	  line++;
+	  if (depth == 0 && index + 1 < len && buffer[index + 1] != '\n'
+	      && index + 1 - chunk_start >= target)
+	    {
+	      if (size <= (n + 1) * sizeof(struct lex_chunk))
+		chunk = (struct lex_chunk *) checked_grow_alloc(chunk, &size);
+	      memset(&chunk[n + 1], 0, sizeof(struct lex_chunk));
+	      chunk[n + 1].start = index + 1;
+	      chunk[n + 1].line = line;
+	      chunk_start = index + 1;
+	      n++;
+	    }
+	  break;
+	}
+    }
+  n++;
+  int i;
+  for (i = 0; i < n; i++)
+    chunk[i].end = i + 1 < n ? chunk[i + 1].start : len;
+  *chunks = chunk;
+  return n;
+}
+
+/* The work shared by the threads of the lexing pool */
+struct lex_pool
+{
+  char *buffer;
+  struct lex_chunk *chunks;
+  int nchunks;
+  int next;
+  pthread_mutex_t lock;
+};
+
+/* lex_worker() is run by each thread of the lexing pool. It keeps taking the next
+untokenized chunk until there are none left									*/
+void *lex_worker(void *arg)
+{
+  struct lex_pool *pool = (struct lex_pool *) arg;
+  for (;;)
+    {
+      pthread_mutex_lock(&pool->lock);
+      int i = pool->next++;
+      pthread_mutex_unlock(&pool->lock);
+      if (i >= pool->nchunks)
+	return NULL;
+      tokenize_chunk(pool->buffer, &pool->chunks[i]);
+    }
+}
+
+/* tokenize() goes through the char buffer and identifies each "token" or operator 
+and inserts them into a linked list that is the token stream. Large buffers are split
+into top-level chunks that are tokenized on a pool of threads, one per processor, and
+the chunks' token lists are then concatenated in order.							*/
+token_stream_t tokenize(char *buffer)
+{
+  int index = 0;
+  int lineNumber = 1;
+  if (buffer[index] == '\0') 
+    return NULL;
+  while (buffer[index] == '\n')
+    {
+      lineNumber++;
+      index++;
+    }
+  int len = strlen(buffer);
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  char const *env = getenv("PROFSH_LEX_THREADS");
+  if (env)
+    {
+      char *end;
+      long n = strtol(env, &end, 10);
+      if (end != env && *end == '\0' && 0 < n && n <= 1024)
+	nthreads = n;
+    }
+  struct lex_chunk *chunks;
+  int nchunks;
+  if (nthreads > 1 && len >= PARALLEL_LEX_MIN_BYTES)
+    nchunks = split_chunks(buffer, index, len, lineNumber,
+			   len / (nthreads * LEX_CHUNKS_PER_THREAD), &chunks);
+  else
+    {
+      chunks = (struct lex_chunk *) checked_malloc(sizeof(struct lex_chunk));
+      nchunks = 1;
+      chunks[0].start = index;
+      chunks[0].end = len;
+      chunks[0].line = lineNumber;
+    }
+
+  if (nchunks == 1)
+    {
+      chunks[0].error_line = 0;
+      chunks[0].words = chunks[0].word_bytes = 0;
+      memset(chunks[0].tokens, 0, sizeof chunks[0].tokens);
+      tokenize_chunk(buffer, &chunks[0]);
+    }
+  else
+    {
+      struct lex_pool pool;
+      pool.buffer = buffer;
+      pool.chunks = chunks;
+      pool.nchunks = nchunks;
+      pool.next = 0;
+      pthread_mutex_init(&pool.lock, NULL);
+      if (nthreads > nchunks)
+	nthreads = nchunks;
+      pthread_t *threads = (pthread_t *) checked_malloc(nthreads * sizeof(pthread_t));
+      long t;
+      int err;
+      for (t = 0; t < nthreads; t++)
+	if ((err = pthread_create(&threads[t], NULL, lex_worker, &pool)) != 0)
+	  error(1, err, "cannot create lexing thread");
+      for (t = 0; t < nthreads; t++)
+	pthread_join(threads[t], NULL);
+      pthread_mutex_destroy(&pool.lock);
+      free(threads);
+    }
+
+  struct token_stream *head = NULL;
+  struct token_stream *curr = NULL;
+  int i, t;
+  for (i = 0; i < nchunks; i++)
+    {
+      if (chunks[i].error_line)
+	{
+	  print_error(chunks[i].error_line);
+	  exit(1);
+	}
+      for (t = 0; t <= UNKNOWN_TOKEN; t++)
+	parse_stats.tokens[t] += chunks[i].tokens[t];
+      parse_stats.words += chunks[i].words;
+      parse_stats.word_bytes += chunks[i].word_bytes;
+      if (chunks[i].head == NULL)
+	continue;
+      if (curr == NULL)
+	head = chunks[i].head;
+      else
+	{
+	  curr->next = chunks[i].head;
+	  chunks[i].head->prev = curr;
+	}
+      curr = chunks[i].tail;
+    }
+  free(chunks);
   return head; 
 }
 
@@ -485,6 +808,8 @@ void check_tokens(token_stream_t tokenStream)
 			print_error(curr->token.line_num);
 			exit(1);
           }
+	  /* 'then' and 'else' must also follow a separator.  */
+	  /* Fall through.  */
 	case DO_TOKEN:
 		if ((prevToken != SEMICOLON_TOKEN && prevToken != NEWLINE_TOKEN) || curr->token.type == nextToken || nextToken == SEMICOLON_TOKEN || nextStream == NULL)
 		  {
@@ -546,7 +871,6 @@ command_stream_t make_command_stream_helper(token_stream_t tokenStream)
 {
   token_stream_t curr = tokenStream;
   token_stream_t nextStream = NULL;
-  token_stream_t prevStream = NULL;
   command_stream_t tempStream = NULL;
   command_stream_t commandStream = NULL;
   enum token_type nextToken;
@@ -562,7 +886,6 @@ command_stream_t make_command_stream_helper(token_stream_t tokenStream)
   command_stack = (command_t *) checked_malloc(command_stackSize);
   while (curr != NULL)
     {
-      prevStream = curr->prev;
       nextStream = curr->next;
       if (nextStream != NULL)
 	    nextToken = nextStream->token.type;
@@ -572,7 +895,11 @@ command_stream_t make_command_stream_helper(token_stream_t tokenStream)
 	  if (command1 == NULL)
 	    {
 	      command1 = new_command();
-	      word = (char **) checked_malloc(200 * sizeof(char *)); 
+	      int nwords = 0;
+	      token_stream_t w;
+	      for (w = curr; w != NULL && w->token.type == WORD_TOKEN; w = w->next)
+		nwords++;
+	      word = (char **) checked_malloc((nwords + 1) * sizeof(char *)); 
 	      command1->u.word = word;
 	    }
 	  *word = curr->token.word;
@@ -838,6 +1165,7 @@ command_stream_t stream_add(command_stream_t commandStream, command_stream_t ite
       commandStream = item;
       commandStream->prev = item;
       commandStream->next = NULL;
+      commandStream->unread = item;
       commandStream->is_read = 0;
     }
   else
@@ -849,4 +1177,70 @@ command_stream_t stream_add(command_stream_t commandStream, command_stream_t ite
       commandStream->prev = item;
     }
   return commandStream;
-}
\ No newline at end of file
+}
+/* elapsed_since() returns the seconds elapsed since START and resets START to now,
+so that consecutive calls time consecutive phases									*/
+double elapsed_since(struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+  *start = now;
+  return elapsed;
+}
+
+/* count_commands() walks a command tree and tallies each command by its type */
+void count_commands(command_t c)
+{
+  if (c == NULL)
+    return;
+  parse_stats.commands[c->type]++;
+  if (c->type != SIMPLE_COMMAND)
+    {
+      int i;
+      for (i = 0; i < (c->type == IF_COMMAND ? 3 : c->type == SUBSHELL_COMMAND ? 1 : 2); i++)
+	count_commands(c->u.command[i]);
+    }
+}
+
+/* print_parse_stats() tallies the commands in the stream and prints everything gathered
+in parse_stats while the stream was made											*/
+void
+print_parse_stats (command_stream_t s)
+{
+  static char const *const token_name[] =
+    {
+      "WORD", "SEMICOLON", "PIPE", "LEFT_PAREN", "RIGHT_PAREN", "LESS_THAN",
+      "GREATER_THAN", "IF", "THEN", "ELSE", "FI", "WHILE", "DO", "DONE",
+      "UNTIL", "NEWLINE", "UNKNOWN"
+    };
+  static char const *const command_name[] =
+    {
+      "IF", "PIPE", "SEQUENCE", "SIMPLE", "SUBSHELL", "UNTIL", "WHILE"
+    };
+  int i;
+  memset(parse_stats.commands, 0, sizeof parse_stats.commands);
+  for (; s != NULL; s = s->next)
+    count_commands(s->command);
+
+  fprintf(stderr, "bytes read: %zu\n", parse_stats.bytes_read);
+  fprintf(stderr, "tokens:\n");
+  for (i = 0; i <= UNKNOWN_TOKEN; i++)
+    if (parse_stats.tokens[i])
+      fprintf(stderr, "  %-12s %zu\n", token_name[i], parse_stats.tokens[i]);
+  fprintf(stderr, "commands:\n");
+  for (i = 0; i <= WHILE_COMMAND; i++)
+    if (parse_stats.commands[i])
+      fprintf(stderr, "  %-12s %zu\n", command_name[i], parse_stats.commands[i]);
+  fprintf(stderr, "words: %zu (%zu bytes), distinct: %zu (%zu bytes)\n",
+	  parse_stats.words, parse_stats.word_bytes,
+	  parse_stats.unique_words, parse_stats.unique_bytes);
+  fprintf(stderr, "peak token stack depth: %d\n", parse_stats.max_token_depth);
+  fprintf(stderr, "peak command stack depth: %d\n", parse_stats.max_command_depth);
+  fprintf(stderr, "allocated: %zu bytes in %zu calls\n",
+	  allocation_bytes(), allocation_count());
+  fprintf(stderr, "time in read_stream: %.6f s\n", parse_stats.read_time);
+  fprintf(stderr, "time in tokenize: %.6f s\n", parse_stats.tokenize_time);
+  fprintf(stderr, "time in check_tokens: %.6f s\n", parse_stats.check_time);
+  fprintf(stderr, "time in make_command_stream_helper: %.6f s\n", parse_stats.build_time);
+}
@@ -0,0 +1,95 @@
+#! /bin/sh
+
+# UCLA CS 111 Lab 1 - Test that -j and -l limit the processes spawned.
+
+# Copyright 2012-2014 Paul Eggert.
+
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+tmp=$0-$$.tmp
+mkdir "$tmp" || exit
+
+(
+cd "$tmp" || exit
+
+# Each job logs its start and end, and is busy in between.
+cat >step <<'EOF'
+echo start $1 >>log
+sleep 0.2
+echo end $1 >>log
+EOF
+
+for run in a b; do
+  {
+    echo "sh step $run$run"
+    echo "sh step $run$run$run"
+    echo "sh step $run$run$run$run"
+  } >$run.sh || exit
+done
+
+# Two runs with -j 1 share the pool, so no two jobs overlap, even
+# across runs: every start is followed by its own end.
+rm -f log
+../profsh -j 1 a.sh & a=$!
+../profsh -j 1 b.sh & b=$!
+wait $a || exit
+wait $b || exit
+test $(wc -l <log) -eq 12 || {
+  echo >&2 "-j 1: jobs missing from the log"
+  cat >&2 log
+  exit 1
+}
+awk '
+  NR % 2 == 1 { if ($1 != "start") exit 1; job = $2 }
+  NR % 2 == 0 { if ($1 != "end" || $2 != job) exit 1 }
+' log || {
+  echo >&2 "-j 1: jobs overlapped"
+  cat >&2 log
+  exit 1
+}
+
+# A job wider than -j still runs, alone.
+echo 'echo wide | cat | cat | tr a-z A-Z' >wide.sh || exit
+../profsh -j 1 wide.sh >wide.out || exit
+echo WIDE | diff -u - wide.out || exit
+
+../profsh -j 2 -l 1000 wide.sh >wide.out || exit
+echo WIDE | diff -u - wide.out || exit
+
+# Bad limits are rejected before anything runs.
+echo ': >ran' >ran.sh || exit
+status=0
+for bad in '-j 0' '-j -1' '-j' '-j x' '-j 2x' '-j 99999999999' \
+  '-l 0' '-l -0.5' '-l x' '-l 1x' '-l nan'
+do
+  ../profsh $bad ran.sh 2>err && {
+    echo >&2 "unexpectedly accepted: $bad"
+    status=1
+  }
+  test -s err || {
+    echo >&2 "no error message for: $bad"
+    status=1
+  }
+  test ! -f ran || {
+    echo >&2 "ran the script despite: $bad"
+    rm -f ran
+    status=1
+  }
+done
+
+exit $status
+) || exit
+
+rm -fr "$tmp"
@@ -0,0 +1,115 @@
+#! /bin/sh
+
+# UCLA CS 111 Lab 1 - Test that a script large enough to be tokenized in
+# parallel chunks parses exactly as its pieces do one at a time.
+
+# Copyright 2012-2014 Paul Eggert.
+
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+tmp=$0-$$.tmp
+mkdir "$tmp" || exit
+
+(
+cd "$tmp" || exit
+
+# Compound commands span lines, so some of them straddle the points
+# where a big script is split into chunks.
+cat >block.sh <<'EOF'
+# a comment, (with an unbalanced parenthesis
+cat < in | tr a-z A-Z >out
+
+if a; then
+  while b
+  do (c | d
+      e)
+  done
+else f; fi
+
+until g; do :; done >h
+EOF
+
+# 2^14 copies of the block make a script of about 2.5 MB, over the 1 MB
+# at which tokenizing goes parallel.  PROFSH_LEX_THREADS=1 tokenizes it
+# in one piece, and =4 in parallel chunks, however many processors there
+# are.
+cp block.sh big.sh || exit
+i=0
+while test $i -lt 14; do
+  cat big.sh big.sh >big2.sh && mv big2.sh big.sh || exit
+  i=$((i+1))
+done
+copies=16384
+lines=$(wc -l <block.sh)
+
+# The block on its own is far too small to split.  The big script's
+# tree must be the block's, renumbered, once per copy.
+../profsh -t block.sh >block.out 2>block.err || exit
+test ! -s block.err || {
+  cat block.err
+  exit 1
+}
+per=$(grep -c '^# ' block.out)
+awk -v copies=$copies -v per=$per '
+  { line[NR] = $0 }
+  END {
+    for (c = 0; c < copies; c++)
+      for (i = 1; i <= NR; i++)
+        if (line[i] ~ /^# [0-9]+$/)
+          print "# " c * per + substr(line[i], 3)
+        else
+          print line[i]
+  }' block.out >big.exp || exit
+
+for threads in 1 4; do
+  PROFSH_LEX_THREADS=$threads ../profsh -t big.sh >big.out 2>big.err || exit
+  cmp -s big.exp big.out || {
+    echo >&2 "$threads threads: big script parsed differently from its blocks"
+    diff big.exp big.out | head -20 >&2
+    exit 1
+  }
+  test ! -s big.err || {
+    cat big.err
+    exit 1
+  }
+done
+
+# Errors report the same line in parallel as in one piece, wherever they
+# fall: in the first chunk, in a later one, or at the very end.  One is
+# found by the lexer, the other by the syntax check.
+status=0
+for where in 3 $((copies / 2 * lines + 2)) $((copies * lines + 1)); do
+  for bad in '`' 'a;;b'; do
+    awk -v where=$where -v bad="$bad" '
+      NR == where { print bad }
+      { print }
+      END { if (NR < where) print bad }' big.sh >bad.sh || exit
+    PROFSH_LEX_THREADS=1 ../profsh -t bad.sh >bad.out 2>bad.exp && {
+      echo >&2 "line $where: unexpectedly succeeded for: $bad"
+      status=1
+      continue
+    }
+    PROFSH_LEX_THREADS=4 ../profsh -t bad.sh >bad.out 2>bad.err && {
+      echo >&2 "line $where: succeeded only in parallel for: $bad"
+      status=1
+      continue
+    }
+    diff -u bad.exp bad.err || status=1
+  done
+done
+
+exit $status
+) || exit
+
+rm -fr "$tmp"
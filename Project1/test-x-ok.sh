@@ -0,0 +1,93 @@
+#! /bin/sh
+
+# UCLA CS 111 Lab 1 - Test that commands are executed correctly.
+
+# Copyright 2012-2014 Paul Eggert.
+
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+tmp=$0-$$.tmp
+mkdir "$tmp" || exit
+
+(
+cd "$tmp" || exit
+
+printf 'pear\napple\nfig\n' >fruit || exit
+
+cat >test.sh <<'EOF'
+echo one; echo two
+echo three
+echo four
+
+echo piped | tr a-z A-Z
+cat fruit | sort | tr a-z A-Z
+
+(echo in; echo subshell) | cat
+(echo out; echo side) >sub
+cat sub
+
+sort <fruit >sorted
+cat <sorted
+
+if test -f fruit; then echo yes; else echo no; fi
+if test -f nothing; then echo yes; else echo no; fi
+
+while test ! -f flag; do echo looped; : >flag; done
+until test ! -f flag; do echo unlooped; rm flag; done
+
+echo last
+false
+EOF
+
+cat >test.exp <<'EOF'
+one
+two
+three
+four
+PIPED
+APPLE
+FIG
+PEAR
+in
+subshell
+out
+side
+apple
+fig
+pear
+yes
+no
+looped
+unlooped
+last
+EOF
+
+../profsh test.sh >test.out 2>test.err
+status=$?
+test $status -eq 1 || {
+  echo >&2 "exit status $status, not the last command's 1"
+  exit 1
+}
+
+diff -u test.exp test.out || exit
+
+test ! -s test.err || {
+  cat test.err
+  exit 1
+}
+
+) || exit
+
+rm -fr "$tmp"
@@ -13,6 +13,24 @@
 #include <linux/blkdev.h>
 #include <linux/wait.h>
 #include <linux/file.h>
+#include <linux/seqlock.h>
+#include <linux/bio.h>
+#include <linux/highmem.h>
+#include <linux/radix-tree.h>
+#include <linux/rbtree.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/pagemap.h>
+#include <linux/ktime.h>
+#include <linux/crypto.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <asm/uaccess.h>
+#include <asm/div64.h>
 
 #include "spinlock.h"
 #include "osprd.h"
@@ -24,6 +42,14 @@
  * is locked. */
 #define F_OSPRD_LOCKED	0x80000
 
+/* This flag is added too if the lock is a per-CPU read lock; see
+ * osprd_lock(). */
+#define F_OSPRD_PERCPU	0x100000
+
+/* This flag is added too if the lock is a write lock.  A file open for
+ * writing takes a write lock, but may downgrade it to a read lock. */
+#define F_OSPRD_WRITELOCK	0x200000
+
 /* eprintk() prints messages to the console.
  * (If working on a real Linux machine, change KERN_NOTICE to KERN_ALERT or
  * KERN_EMERG so that you are sure to see the messages.  By default, the
@@ -43,113 +69,2738 @@ MODULE_AUTHOR("Kevin Zuo and Eric Yang");
 static int nsectors = 32;
 module_param(nsectors, int, 0);
 
+/* This module parameter selects how I/O reaches the device.  By default,
+ * requests pass through the elevator and osprd_process_request_queue; with
+ * "insmod osprd.ko make_request=1" each bio is handled directly by
+ * osprd_make_request as soon as it is submitted.  This kernel has no
+ * multi-queue block layer, and a request queue has just one lock, which
+ * every request takes; make_request=1 is as close to per-CPU submission
+ * as it gets.  Each bio is then served and completed by the task that
+ * submitted it, on its own CPU, and bios on different CPUs share only the
+ * page tree's locks, the seqlocks of any pages they both touch, and, on a
+ * device that emulates a slower disk, its emu_lock. */
+static int make_request = 0;
+module_param(make_request, int, 0);
+
+/* The data is kept in pages, found by page index in a radix tree.  A page
+ * is allocated the first time one of its sectors is written; sectors of
+ * pages that were never written read as zeros.  OSPRDIOCDISCARD frees the
+ * pages of a sector range again.  So a device costs only the memory holding
+ * live data, and its size is not bounded by vmalloc space.
+ *
+ * Data transfers do not take the device 'mutex'.  Instead page i is
+ * guarded by seqlock stripe[i % OSPRD_NSTRIPES].  Writers take the
+ * seqlocks of the pages they touch, so only overlapping writes serialize;
+ * readers take no seqlock and simply retry a page's copy if a writer
+ * changed it meanwhile.  The radix tree itself is protected by
+ * OSPRD_PAGE_LOCKS reader-writer locks, 'pages_locks': a reader takes just
+ * the one for its CPU, so readers on different CPUs rarely share a lock or
+ * cache line, and a writer, who only adds or removes pages, takes them all.
+ * There are no more of them than a writer may hold at once on a lockdep
+ * kernel, each in its own lock class.  Each stripe has a cache line to
+ * itself for the same reason.
+ *
+ * OSPRDIOCSNAPSHOT turns a device into a read-only snapshot of another,
+ * sharing its pages: each page is referenced by both trees, and a page with
+ * more than one reference is never written in place.  A writer that finds
+ * its page shared first replaces it with a private copy, so each page is
+ * copied only the first time the origin writes it after a snapshot.
+ * Readers and writers alike copy data while read-locking the tree, which
+ * lets osprd_snapshot freeze the origin by write-locking it. */
+#define OSPRD_PAGE_SECTORS	(PAGE_SIZE / SECTOR_SIZE)
+#define OSPRD_NSTRIPES		64
+#define OSPRD_PAGE_LOCKS	16
+
+/* In compressed mode (the 'compress' module parameter) the 'pages' tree
+ * holds an osprd_zpage_t for each page rather than the page itself.  A page
+ * whose words all have the same value keeps just that value, and a page of
+ * zeros is not kept at all, just as if it were never written.  Any other
+ * page is compressed and kept in an object of the smallest size class that
+ * fits it.  Classes are OSPRD_ZSTEP bytes apart and each has its own slab
+ * cache, so compressed pages pack densely however their lengths vary.  A
+ * page that does not compress to fit the largest class is kept as is, in a
+ * page of its own. */
+#define OSPRD_ZSTEP		256
+#define OSPRD_ZCLASSES		(PAGE_SIZE / OSPRD_ZSTEP)
+
+
+/* A request waiting for the device lock, linked into the device's 'waiters'
+ * queue.  For a task blocked in osprd_acquire it lives on that task's
+ * stack; a request queued with OSPRDIOCQUEUEACQUIRE is allocated by
+ * osprd_queue and hangs off its file's osprd_file_t. */
+typedef struct osprd_waiter {
+	struct list_head link;		// In 'waiters'
+	struct task_struct *task;	// The waiting task, or NULL if the
+					// request was queued
+	pid_t pid;			// The requesting process
+	struct file *filp;		// The file that will hold the lock
+	u64 since;			// When it started waiting, in ns
+	int write;			// Wants a write lock?
+	int granted;			// Set by osprd_grant once it holds
+					// the lock
+} osprd_waiter_t;
+
+/* A page of a compressed device; see OSPRD_ZSTEP. */
+typedef struct osprd_zpage {
+	unsigned long index;		// The page's index in the device
+	unsigned long fill;		// Every word's value, if 'data' is NULL
+	char *data;			// The compressed page, or NULL
+	unsigned len;			// Bytes in 'data'; PAGE_SIZE if the
+					// page is kept uncompressed
+} osprd_zpage_t;
+
+/* A compressor and the buffers it works in.  There is one per CPU, used
+ * with preemption disabled. */
+typedef struct osprd_zstream {
+	struct crypto_tfm *tfm;
+	char *page;			// A page being compressed or read
+	char *out;			// The page's compressed form
+} osprd_zstream_t;
+
+/* With the 'checksum' module parameter, a device keeps the CRC32C of every
+ * sector it holds, in an osprd_crcs_t per page in its 'crcs' tree.  A write
+ * stores its sectors' checksums in the same critical section that copies
+ * their data, and a read copies the checksums along with the data, so they
+ * always agree unless something other than osprd wrote to the ramdisk's
+ * memory.  The read then checks each sector; one that does not match fails
+ * the read with -EIO and counts in 'crc_errors'.  A page never written has
+ * no osprd_crcs_t; new ones start out with the checksum of a zero sector.
+ * The CRC uses the SSE4.2 crc32 instruction, on three sectors at once, if
+ * the CPU has it and tables, eight bytes at a time, if not; see
+ * osprd_crc32c(). */
+typedef struct osprd_crcs {
+	unsigned long index;		// The page's index in the device
+	u32 crc[OSPRD_PAGE_SECTORS];	// Each sector's CRC32C
+} osprd_crcs_t;
+
+/* A request, or with make_request=1 a bio, whose data has been transferred
+ * but whose completion is held back to emulate a slower disk; see
+ * osprd_emu_delay(). */
+typedef struct osprd_delayed {
+	struct list_head link;		// In 'emu_list', by 'due'
+	u64 due;			// When to complete it, in ns
+	struct request *req;		// The request, or
+	struct bio *bio;		// ...the bio
+	int error;			// Its result: 0 or an error
+	int write;			// Was it a write?
+	unsigned long bytes;		// Its size
+	u64 start;			// When its service started, in ns
+} osprd_delayed_t;
+
+/* The osprd state of an open file, in its private_data; see osprd_open(). */
+typedef struct osprd_file {
+	osprd_waiter_t *queued;		// Request queued with
+					// OSPRDIOCQUEUEACQUIRE, or NULL
+	u64 locked_at;			// When the lock was granted, in ns
+} osprd_file_t;
+
+#define OSPRD_HIST	32		// Buckets in a log2 histogram
+
+/* I/O and lock statistics of a device.  They are kept per CPU, so that
+ * counting costs no shared cache lines; /proc/osprd adds them up.  Index
+ * [0] is for reads and readers, [1] for writes and writers.  Histogram
+ * bucket b counts values v with 2^(b-1) <= v < 2^b (bucket 0 counts 0). */
+typedef struct osprd_stats {
+	unsigned long ops[2];			// Requests served
+	unsigned long long bytes[2];		// ...and their bytes
+	unsigned long size[2][OSPRD_HIST];	// Request sizes in bytes
+	unsigned long latency[2][OSPRD_HIST];	// Service times in ns
+	unsigned long locks[2];			// Lock acquisitions
+	unsigned long wait[2][OSPRD_HIST];	// Waits for the lock in us
+	unsigned long hold[2][OSPRD_HIST];	// Lock hold times in us
+	unsigned long cancels;			// Lock requests given up
+	unsigned long wakeups;			// Waiters woken with the lock
+	unsigned long long zns[2];		// Time spent decompressing and
+						// compressing pages in ns
+	unsigned long long zbytes[2];		// ...and the bytes of those pages
+	unsigned long crc_errors;		// Sectors read that failed their
+						// checksum
+} osprd_stats_t;
+
+/* One of the locks on a device's page tree, and a stripe seqlock; see
+ * OSPRD_NSTRIPES.  Each has a cache line of its own. */
+typedef struct osprd_pages_lock {
+	rwlock_t lock;
+} ____cacheline_aligned_in_smp osprd_pages_lock_t;
+
+typedef struct osprd_stripe {
+	seqlock_t lock;
+} ____cacheline_aligned_in_smp osprd_stripe_t;
+
+/* A range lock, granted or waiting, in the device's 'ranges' tree. */
+typedef struct osprd_range_lock {
+	struct rb_node node;		// In 'ranges', sorted by 'start'
+	sector_t start, end;		// The sectors [start, end)
+	sector_t max_end;		// Largest 'end' in this subtree
+	unsigned long long ticket;	// Order of arrival
+	int write;			// Write lock?
+	int granted;			// Held, or still waiting?
+	struct file *filp;		// The file that holds it
+	struct task_struct *task;	// The task waiting for it
+} osprd_range_lock_t;
 
 /* The internal representation of our device. */
 typedef struct osprd_info {
-	uint8_t *data;                  // The data array. Its size is
-	                                // (nsectors * SECTOR_SIZE) bytes.
+	struct radix_tree_root pages;	// The data pages, by page index
+	// Protect the 'pages' tree; see osprd_read_lock_pages()
+	osprd_pages_lock_t pages_locks[OSPRD_PAGE_LOCKS];
+	atomic_t nr_pages;		// Number of pages in 'pages'
 
 	osp_spinlock_t mutex;           // Mutex for synchronizing access to
 					// this block device
 
-	unsigned ticket_head;		// Currently running ticket for
-					// the device lock
+	struct list_head waiters;	// Tasks blocked on the device lock,
+					// oldest first; see osprd_acquire()
+
+	osprd_waiter_t *upgrader;	// A reader waiting to upgrade, who
+					// goes first; see osprd_upgrade()
+
+	wait_queue_head_t pollq;	// Pollers waiting for queued lock
+					// requests; see osprd_poll()
+
+	struct rb_root ranges;		// Range locks, granted or waiting;
+					// see osprd_range_acquire()
+
+	unsigned long long range_ticket;	// Next range lock ticket
+
+	int *pcpu_readers;		// Per-CPU reader counts, or NULL if
+					// not in per-CPU mode; see osprd_lock()
+
+	atomic_t pcpu_writers;		// Writers holding or wanting the lock
+					// in per-CPU mode
+
+	wait_queue_head_t pcpu_drain;	// Writers waiting for per-CPU
+					// readers to drain
+
+	osprd_stats_t *stats;		// Per-CPU statistics; see
+					// osprd_proc_show()
+
+	unsigned long nsectors;		// The device's size in sectors; see
+					// osprd_resize()
+
+	struct osprd_info *origin;	// The device this is a read-only
+					// snapshot of, or NULL
+
+	int compress;			// Are pages kept compressed? See
+					// OSPRD_ZSTEP
+	atomic_long_t zbytes;		// Memory holding compressed pages
+	atomic_t zsame;			// Pages kept as just a fill value
+
+	int dax;			// Direct access? See osprd_dax_rw()
+
+	int checksum;			// Are sectors checksummed? See
+					// osprd_crcs_t
+	struct radix_tree_root crcs;	// The pages' checksums, by page
+					// index; protected by 'pages_locks'
+
+	struct osprd_emulation emu;	// The slower disk emulated, if any;
+					// see osprd_emu_delay()
+	spinlock_t emu_lock;		// Protects 'emu' and the following
+	struct list_head emu_list;	// Delayed completions, soonest first
+	struct hrtimer emu_timer;	// Fires at the first one's 'due'
+	struct work_struct emu_work;	// Queued by 'emu_timer' to complete
+					// them
+	u64 emu_free;			// When the emulated bandwidth is
+					// next free, in ns
+	unsigned emu_random;		// Random state for the jitter
+	unsigned emu_inflight;		// Requests counted against
+					// emu.depth
+	int emu_held;			// Did the request function leave
+					// requests queued for lack of depth?
+	wait_queue_head_t emuq;		// make_request waits here for depth
+
+	struct file *bfile;		// The backing file, or NULL; see
+					// osprd_flusher()
+	unsigned long *dirty;		// Bitmap of pages not yet written to
+					// 'bfile'
+	atomic_t ndirty;		// Bits set in 'dirty'
+	unsigned long dirty_npages;	// Pages 'dirty' has room for
+	struct mutex flush_mutex;	// Held while writing to 'bfile' or
+					// resizing
+	char *flush_buf;		// A page to write from
+	struct task_struct *flusher;	// The thread that writes dirty pages
+	wait_queue_head_t flushq;	// ...and waits here for them
+	wait_queue_head_t cleanq;	// Writers waiting for fewer dirty
+					// pages
+
+	pid_t curr_writer;
+
+	int num_readers;
+
+	int num_writers;
+
+	osprd_stripe_t stripe[OSPRD_NSTRIPES];	// Guards the data pages; see
+						// osprd_transfer()
+
+	// The following elements are used internally; you don't need
+	// to understand them.
+	struct request_queue *queue;    // The device request queue.
+	spinlock_t qlock;		// Used internally for mutual
+	                                //   exclusion in the 'queue'.
+	struct gendisk *gd;             // The generic disk.
+} osprd_info_t;
+
+#define NOSPRD 16		// The most devices there can be
+static osprd_info_t osprds[NOSPRD];
+
+/* These module parameters choose how many devices there are, and their
+ * sizes in sectors; a device without a size gets 'nsectors'.
+ * "insmod osprd.ko ndevices=3 sizes=2048,0,65536" makes osprda 1 MB,
+ * osprdb 'nsectors' sectors and osprdc 32 MB.  OSPRDIOCRESIZE changes a
+ * device's size while it is in use. */
+static int ndevices = 4;
+module_param(ndevices, int, 0);
+static int sizes[NOSPRD];
+module_param_array(sizes, int, NULL, 0);
+
+/* This module parameter puts devices in per-CPU reader mode, where read
+ * locks are nearly free and write locks are expensive; see osprd_lock().
+ * "insmod osprd.ko percpu=1,0,0,1" does this for osprda and osprdd. */
+static int percpu[NOSPRD];
+module_param_array(percpu, int, NULL, 0);
+
+/* This module parameter keeps the pages of some devices compressed, trading
+ * CPU time for memory; see OSPRD_ZSTEP.  "insmod osprd.ko compress=0,1"
+ * does this for osprdb. */
+static int compress[NOSPRD];
+module_param_array(compress, int, NULL, 0);
+
+/* These module parameters give devices a backing file, where the flusher
+ * thread writes their data in the background and from which they are
+ * loaded when the module is: "insmod osprd.ko backing=/var/osprda.img".
+ * 'dirty_kb' bounds the data not yet written out; writes wait beyond it. */
+static char *backing[NOSPRD];
+module_param_array(backing, charp, NULL, 0);
+static int dirty_kb = 4096;
+module_param(dirty_kb, int, 0);
+
+/* Opens of a device are normally made O_SYNC, so every write reaches the
+ * ramdisk before it returns.  This module parameter lets the opens of some
+ * devices write back through the page cache instead, like any other block
+ * device: "insmod osprd.ko writeback=1".  A file can also switch with
+ * OSPRDIOCSETSYNC.  Either way OSPRDIOCFLUSH and fsync() are barriers: after
+ * them the ramdisk, and so any snapshot taken later, holds every write made
+ * before, and fsync() also waits for the backing file, as OSPRDIOCSYNC does. */
+static int writeback[NOSPRD];
+module_param_array(writeback, int, NULL, 0);
+
+/* This module parameter gives some devices direct access: read() and write()
+ * copy between the user and the ramdisk's own pages, and mmap() maps those
+ * pages, so no data passes through, or is kept twice in, the page cache.
+ * "insmod osprd.ko dax=1".  It cannot be combined with 'compress'. */
+static int dax[NOSPRD];
+module_param_array(dax, int, NULL, 0);
+
+/* This module parameter checksums every sector of some devices, so reads
+ * notice data that stray writes corrupted; see osprd_crcs_t.
+ * "insmod osprd.ko checksum=1,1".  It cannot be combined with 'compress' or
+ * 'dax'. */
+static int checksum[NOSPRD];
+module_param_array(checksum, int, NULL, 0);
+
+/* These module parameters make some devices emulate slower disks, to test
+ * filesystems and databases against: each request completes, from a timer,
+ * 'latency_us' plus a random jitter after it would have finished on a disk
+ * of 'bandwidth_kb' KB/s, and at most 'queue_depth' requests are in
+ * flight.  The jitter is uniform in [0, jitter_us), or exponential with
+ * mean 'jitter_us' for devices with 'jitter_exp'.  "insmod osprd.ko
+ * latency_us=5000 jitter_us=2000 bandwidth_kb=40960 queue_depth=32"
+ * emulates a rather slow disk on osprda.  OSPRDIOCSETEMU changes these
+ * while a device is in use. */
+static int latency_us[NOSPRD];
+module_param_array(latency_us, int, NULL, 0);
+static int jitter_us[NOSPRD];
+module_param_array(jitter_us, int, NULL, 0);
+static int jitter_exp[NOSPRD];
+module_param_array(jitter_exp, int, NULL, 0);
+static int bandwidth_kb[NOSPRD];
+module_param_array(bandwidth_kb, int, NULL, 0);
+static int queue_depth[NOSPRD];
+module_param_array(queue_depth, int, NULL, 0);
+
+static u32 osprd_crc_table[8][256];	// See osprd_crc_init()
+static int osprd_crc_sse42;		// Does the CPU have crc32?
+static u32 osprd_crc_zero;		// The CRC32C of a zero sector
+
+static kmem_cache_t *osprd_zcache[OSPRD_ZCLASSES];	// [0] holds the
+							// osprd_zpage_ts
+static char osprd_zcache_name[OSPRD_ZCLASSES][16];
+static osprd_zstream_t *osprd_zstreams;			// Per CPU
+static kmem_cache_t *osprd_delayed_cache;		// osprd_delayed_ts
+
+
+// Declare useful helper functions
+
+/*
+ * file2osprd(filp)
+ *   Given an open file, check whether that file corresponds to an OSP ramdisk.
+ *   If so, return a pointer to the ramdisk's osprd_info_t.
+ *   If not, return NULL.
+ */
+static osprd_info_t *file2osprd(struct file *filp);
+
+/*
+ * for_each_open_file(task, callback, user_data)
+ *   Given a task, call the function 'callback' once for each of 'task's open
+ *   files.  'callback' is called as 'callback(filp, user_data)'; 'filp' is
+ *   the open file, and 'user_data' is copied from for_each_open_file's third
+ *   argument.
+ */
+static void for_each_open_file(struct task_struct *task,
+			       void (*callback)(struct file *filp,
+						osprd_info_t *user_data),
+			       osprd_info_t *user_data);
+
+
+/* osprd_now() returns the time in ns, for the statistics.					*/
+static u64 osprd_now(void)
+{
+	struct timespec ts;
+
+	ktime_get_ts(&ts);
+	return timespec_to_ns(&ts);
+}
+
+/* osprd_us(ns) converts ns to us. do_div() keeps 32-bit kernels happy.	*/
+static u64 osprd_us(u64 ns)
+{
+	do_div(ns, 1000);
+	return ns;
+}
+
+/* osprd_hist(v) returns v's bucket in a log2 histogram.					*/
+static int osprd_hist(u64 v)
+{
+	int b = fls64(v);
+
+	return b < OSPRD_HIST ? b : OSPRD_HIST - 1;
+}
+
+/* osprd_stat_io(d, write, bytes, start) counts a request of 'bytes' bytes
+whose service started at time 'start'. Requests are counted either under
+the queue lock or, with make_request=1, in process context, never both, so
+a counter is never updated from two contexts on one CPU at once. Delayed
+requests are counted by the work their device's timer schedules, also in
+process context.															*/
+static void osprd_stat_io(osprd_info_t *d, int write, unsigned long bytes,
+			  u64 start)
+{
+	u64 ns = osprd_now() - start;
+	osprd_stats_t *s = per_cpu_ptr(d->stats, get_cpu());
+
+	s->ops[write]++;
+	s->bytes[write] += bytes;
+	s->size[write][osprd_hist(bytes)]++;
+	s->latency[write][osprd_hist(ns)]++;
+	put_cpu();
+}
+
+/* osprd_file(filp) returns the osprd state of an open file.				*/
+static osprd_file_t *osprd_file(struct file *filp)
+{
+	return (osprd_file_t *) filp->private_data;
+}
+
+/* osprd_stat_locked(d, filp, write, since) counts a lock granted to filp
+after waiting since time 'since', or without waiting if 'since' is 0, and
+starts timing how long filp holds it.									*/
+static void osprd_stat_locked(osprd_info_t *d, struct file *filp, int write,
+			      u64 since)
+{
+	u64 now = osprd_now();
+	osprd_stats_t *s = per_cpu_ptr(d->stats, get_cpu());
+
+	s->locks[write]++;
+	s->wait[write][osprd_hist(since ? osprd_us(now - since) : 0)]++;
+	put_cpu();
+	osprd_file(filp)->locked_at = now;
+}
+
+/* osprd_stat_unlocked(d, filp, write) counts how long filp held its lock.	*/
+static void osprd_stat_unlocked(osprd_info_t *d, struct file *filp, int write)
+{
+	u64 held = osprd_now() - osprd_file(filp)->locked_at;
+	osprd_stats_t *s = per_cpu_ptr(d->stats, get_cpu());
+
+	s->hold[write][osprd_hist(osprd_us(held))]++;
+	put_cpu();
+}
+
+/* osprd_stat_count(d, field) adds one to a counter.						*/
+#define osprd_stat_count(d, field) do {					\
+		per_cpu_ptr((d)->stats, get_cpu())->field++;		\
+		put_cpu();						\
+	} while (0)
+
+/* osprd_crc32c(p, n, crcs) sets crcs[i] to the CRC32C of sector i of the n
+sectors at p. The crc32 instruction takes three cycles, but the CPU can
+start one every cycle, so one sector's dependent chain would leave it idle
+two cycles in three. Each sector has a checksum of its own, so there is
+nothing to combine: three sectors are checksummed at once, in three
+chains, and the last one or two sectors of a run repeat a sector to fill
+the third. The instruction is spelled in bytes for assemblers that predate
+SSE4.2.																	*/
+static void osprd_crc32c(const unsigned char *p, unsigned long n, u32 *crcs)
+{
+	u32 (*t)[256] = osprd_crc_table;
+	const unsigned char *p1, *p2;
+	u32 crc;
+	int i;
+
+#if defined(CONFIG_X86_64)
+	if (osprd_crc_sse42) {
+		for (; n > 0; n -= min(n, 3UL), p += 3 * SECTOR_SIZE, crcs += 3) {
+			unsigned long a = ~0U, b = ~0U, c = ~0U;
+			p1 = n > 1 ? p + SECTOR_SIZE : p;
+			p2 = n > 2 ? p + 2 * SECTOR_SIZE : p1;
+			for (i = 0; i < SECTOR_SIZE; i += 8) {
+				// crc32q %rcx, %rax; %rcx, %rdx; %rcx, %rbx
+				asm(".byte 0xf2, 0x48, 0x0f, 0x38, 0xf1, 0xc1"
+				    : "=a" (a) : "0" (a), "c" (*(u64 *) (p + i)));
+				asm(".byte 0xf2, 0x48, 0x0f, 0x38, 0xf1, 0xd1"
+				    : "=d" (b) : "0" (b), "c" (*(u64 *) (p1 + i)));
+				asm(".byte 0xf2, 0x48, 0x0f, 0x38, 0xf1, 0xd9"
+				    : "=b" (c) : "0" (c), "c" (*(u64 *) (p2 + i)));
+			}
+			crcs[0] = ~a;
+			if (n > 1)
+				crcs[1] = ~b;
+			if (n > 2)
+				crcs[2] = ~c;
+		}
+		return;
+	}
+#elif defined(CONFIG_X86)
+	if (osprd_crc_sse42) {
+		for (; n > 0; n -= min(n, 3UL), p += 3 * SECTOR_SIZE, crcs += 3) {
+			u32 a = ~0, b = ~0, c = ~0;
+			p1 = n > 1 ? p + SECTOR_SIZE : p;
+			p2 = n > 2 ? p + 2 * SECTOR_SIZE : p1;
+			for (i = 0; i < SECTOR_SIZE; i += 4) {
+				// crc32l %ecx, %eax; %ecx, %edx; %ecx, %ebx
+				asm(".byte 0xf2, 0x0f, 0x38, 0xf1, 0xc1"
+				    : "=a" (a) : "0" (a), "c" (*(u32 *) (p + i)));
+				asm(".byte 0xf2, 0x0f, 0x38, 0xf1, 0xd1"
+				    : "=d" (b) : "0" (b), "c" (*(u32 *) (p1 + i)));
+				asm(".byte 0xf2, 0x0f, 0x38, 0xf1, 0xd9"
+				    : "=b" (c) : "0" (c), "c" (*(u32 *) (p2 + i)));
+			}
+			crcs[0] = ~a;
+			if (n > 1)
+				crcs[1] = ~b;
+			if (n > 2)
+				crcs[2] = ~c;
+		}
+		return;
+	}
+#endif
+	for (; n > 0; n--, crcs++) {
+		crc = ~0;
+		for (i = 0; i < SECTOR_SIZE; i += 8, p += 8) {
+			crc ^= p[0] | p[1] << 8 | p[2] << 16 | (u32) p[3] << 24;
+			crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff]
+				^ t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24]
+				^ t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+		}
+		*crcs = ~crc;
+	}
+}
+
+/* osprd_crc_init() builds the CRC32C tables and checks for SSE4.2. Table
+[k][b] is the CRC of byte b followed by k zero bytes, so the CRC of eight
+bytes is the exclusive or of eight lookups ("slicing by 8").				*/
+static void osprd_crc_init(void)
+{
+	u32 c;
+	int b, k;
+
+	for (b = 0; b < 256; b++) {
+		for (c = b, k = 0; k < 8; k++)
+			c = (c >> 1) ^ (c & 1 ? 0x82f63b78 : 0);
+		osprd_crc_table[0][b] = c;
+	}
+	for (b = 0; b < 256; b++)
+		for (k = 1; k < 8; k++) {
+			c = osprd_crc_table[k - 1][b];
+			osprd_crc_table[k][b] = (c >> 8)
+				^ osprd_crc_table[0][c & 0xff];
+		}
+#ifdef CONFIG_X86
+	osprd_crc_sse42 = boot_cpu_data.cpuid_level >= 1
+		&& (cpuid_ecx(1) & (1 << 20));
+#endif
+	osprd_crc32c(page_address(ZERO_PAGE(0)), 1, &osprd_crc_zero);
+}
+
+/* osprd_crc_check(d, sector, nsect, buffer, crcs) checks the nsect sectors
+read into buffer, at most a page of them, against their checksums, and
+counts and reports those that do not match. Returns 0, or -EIO if any did not.							*/
+static int osprd_crc_check(osprd_info_t *d, unsigned long sector,
+			   unsigned long nsect, const char *buffer,
+			   const u32 *crcs)
+{
+	u32 got[OSPRD_PAGE_SECTORS];
+	unsigned long i;
+	int r = 0;
+
+	osprd_crc32c((const unsigned char *) buffer, nsect, got);
+	for (i = 0; i < nsect; i++)
+		if (got[i] != crcs[i]) {
+			osprd_stat_count(d, crc_errors);
+			if (printk_ratelimit())
+				printk(KERN_WARNING "osprd: %s sector %lu "
+				       "fails its checksum\n", d->gd->disk_name,
+				       sector + i);
+			r = -EIO;
+		}
+	return r;
+}
+
+/* osprd_new_crcs(index, gfp) allocates the checksums of a page of zeros.	*/
+static osprd_crcs_t *osprd_new_crcs(unsigned long index, gfp_t gfp)
+{
+	osprd_crcs_t *crcs = kmalloc(sizeof(*crcs), gfp);
+	int i;
+
+	if (crcs) {
+		crcs->index = index;
+		for (i = 0; i < OSPRD_PAGE_SECTORS; i++)
+			crcs->crc[i] = osprd_crc_zero;
+	}
+	return crcs;
+}
+
+/* osprd_free_crcs(crcs) frees a tree of checksums. Nobody else may be using
+the tree.																	*/
+static void osprd_free_crcs(struct radix_tree_root *crcs)
+{
+	osprd_crcs_t *batch[16];
+	unsigned long index = 0;
+	int n, i;
+
+	while ((n = radix_tree_gang_lookup(crcs, (void **) batch,
+					   index, 16)) > 0)
+		for (i = 0; i < n; i++) {
+			index = batch[i]->index + 1;
+			radix_tree_delete(crcs, batch[i]->index);
+			kfree(batch[i]);
+		}
+}
+
+/*
+ * osprd_process_request(d, req)
+ *   Called when the user reads or writes a sector.
+ *   Should perform the read or write, as appropriate.
+ */
+
+/* osprd_read_lock_pages(d) read-locks d's page tree and returns the lock
+taken, which the caller read_unlocks: just the current CPU's one of
+'pages_locks', so readers on different CPUs seldom share a cache line. Any
+one of them would do, so moving to another CPU meanwhile is harmless. The
+writer's side, osprd_write_lock_pages(d), takes them all in order, which
+only adding or removing a page, or swapping trees, needs.					*/
+static rwlock_t *osprd_read_lock_pages(osprd_info_t *d)
+{
+	rwlock_t *l = &d->pages_locks[raw_smp_processor_id()
+				      % OSPRD_PAGE_LOCKS].lock;
+	read_lock(l);
+	return l;
+}
+
+static void osprd_write_lock_pages(osprd_info_t *d)
+{
+	int i;
+	for (i = 0; i < OSPRD_PAGE_LOCKS; i++)
+		write_lock(&d->pages_locks[i].lock);
+}
+
+static void osprd_write_unlock_pages(osprd_info_t *d)
+{
+	int i;
+	for (i = OSPRD_PAGE_LOCKS - 1; i >= 0; i--)
+		write_unlock(&d->pages_locks[i].lock);
+}
+
+/* osprd_lookup_page(d, index) returns the data page at index, or NULL if it
+was never written.															*/
+static struct page *osprd_lookup_page(osprd_info_t *d, unsigned long index)
+{
+	struct page *page;
+	rwlock_t *pl;
+
+	pl = osprd_read_lock_pages(d);
+	page = radix_tree_lookup(&d->pages, index);
+	read_unlock(pl);
+	return page;
+}
+
+/* osprd_add_page(d, page, crcs, index) puts a new zeroed page into the tree
+at index, along with its checksums if crcs is not NULL. The caller holds that
+index's stripe seqlock. Returns 0 or -ENOMEM, in which case neither is added.	*/
+static int osprd_add_page(osprd_info_t *d, struct page *page,
+			  osprd_crcs_t *crcs, unsigned long index)
+{
+	int r = 0;
+
+	page->index = index;
+	osprd_write_lock_pages(d);
+	if (crcs)
+		r = radix_tree_insert(&d->crcs, index, crcs);
+	if (r == 0 && (r = radix_tree_insert(&d->pages, index, page)) < 0
+	    && crcs)
+		radix_tree_delete(&d->crcs, index);
+	osprd_write_unlock_pages(d);
+	if (r == 0)
+		atomic_inc(&d->nr_pages);
+	return r;
+}
+
+/* osprd_page_shared(d, page) returns nonzero if a snapshot shares d's page,
+in which case it must not be written in place. Pages of a direct-access
+device are referenced by the mappings and reads in progress instead; such
+a device is never part of a snapshot.									*/
+static int osprd_page_shared(osprd_info_t *d, struct page *page)
+{
+	return !d->dax && page_count(page) > 1;
+}
+
+/* osprd_unshare_page(d, page, new_page, index) replaces the shared page at
+index with new_page, a private copy of it, and drops d's reference to the
+shared one. The caller holds that index's stripe seqlock, so nobody writes
+either page meanwhile. Replacing the slot needs no memory. Returns 1, or 0
+if page is no longer at index because d's whole tree was replaced by
+osprd_snapshot, in which case new_page is unused.						*/
+static int osprd_unshare_page(osprd_info_t *d, struct page *page,
+			      struct page *new_page, unsigned long index)
+{
+	void **slot;
+
+	new_page->index = index;
+	osprd_write_lock_pages(d);
+	slot = radix_tree_lookup_slot(&d->pages, index);
+	if (!slot || *slot != page) {
+		osprd_write_unlock_pages(d);
+		return 0;
+	}
+	memcpy(page_address(new_page), page_address(page), PAGE_SIZE);
+	*slot = new_page;
+	osprd_write_unlock_pages(d);
+	put_page(page);
+	return 1;
+}
+
+/* osprd_stat_zip(d, write, start) counts a page compressed (write) or
+decompressed (!write) since time 'start'.								*/
+static void osprd_stat_zip(osprd_info_t *d, int write, u64 start)
+{
+	u64 ns = osprd_now() - start;
+	osprd_stats_t *s = per_cpu_ptr(d->stats, get_cpu());
+
+	s->zns[write] += ns;
+	s->zbytes[write] += PAGE_SIZE;
+	put_cpu();
+}
+
+/* osprd_zclass(len) returns the size class for len bytes of compressed data.	*/
+static int osprd_zclass(unsigned len)
+{
+	return (len + OSPRD_ZSTEP - 1) / OSPRD_ZSTEP;
+}
+
+/* osprd_zfree(zp) frees a compressed page.								*/
+static void osprd_zfree(osprd_zpage_t *zp)
+{
+	if (zp->len == PAGE_SIZE)
+		free_page((unsigned long) zp->data);
+	else if (zp->data)
+		kmem_cache_free(osprd_zcache[osprd_zclass(zp->len)], zp->data);
+	kmem_cache_free(osprd_zcache[0], zp);
+}
+
+/* osprd_zaccount(d, zp, n) adds n times zp to d's page and memory counts.	*/
+static void osprd_zaccount(osprd_info_t *d, osprd_zpage_t *zp, int n)
+{
+	long size = sizeof(*zp);
+
+	if (zp->len == PAGE_SIZE)
+		size += PAGE_SIZE;
+	else if (zp->data)
+		size += osprd_zclass(zp->len) * OSPRD_ZSTEP;
+	else
+		atomic_add(n, &d->zsame);
+	atomic_long_add(n * size, &d->zbytes);
+	atomic_add(n, &d->nr_pages);
+}
+
+/* osprd_zload(d, zp, buf) fills buf with the page zp holds, or with zeros
+if zp is NULL. The caller has preemption disabled, since this may use the
+CPU's stream. Returns 0, or -EIO if the page does not decompress.		*/
+static int osprd_zload(osprd_info_t *d, osprd_zpage_t *zp, char *buf)
+{
+	osprd_zstream_t *z;
+	unsigned dlen = PAGE_SIZE;
+	unsigned long fill = zp ? zp->fill : 0;
+	u64 start;
+	int i, r;
+
+	if (!zp || !zp->data)
+		for (i = 0; i < PAGE_SIZE / sizeof(long); i++)
+			((unsigned long *) buf)[i] = fill;
+	else if (zp->len == PAGE_SIZE)
+		memcpy(buf, zp->data, PAGE_SIZE);
+	else {
+		z = per_cpu_ptr(osprd_zstreams, smp_processor_id());
+		start = osprd_now();
+		r = crypto_comp_decompress(z->tfm, zp->data, zp->len,
+					   buf, &dlen);
+		osprd_stat_zip(d, 0, start);
+		if (r < 0 || dlen != PAGE_SIZE)
+			return -EIO;
+	}
+	return 0;
+}
+
+/* osprd_zstore(d, buf, index, zpp) sets *zpp to a new osprd_zpage_t for
+the page in buf, or to NULL if the page is all zeros. The caller has
+preemption disabled. Returns 0 or -ENOMEM.								*/
+static int osprd_zstore(osprd_info_t *d, char *buf, unsigned long index,
+			osprd_zpage_t **zpp)
+{
+	osprd_zstream_t *z = per_cpu_ptr(osprd_zstreams, smp_processor_id());
+	unsigned long *words = (unsigned long *) buf;
+	unsigned dlen = (OSPRD_ZCLASSES - 1) * OSPRD_ZSTEP;
+	osprd_zpage_t *zp;
+	char *from;
+	u64 start;
+	int i;
+
+	*zpp = NULL;
+	for (i = 1; i < PAGE_SIZE / sizeof(long) && words[i] == words[0]; i++)
+		/* do nothing */;
+	if (i == PAGE_SIZE / sizeof(long) && words[0] == 0)
+		return 0;
+
+	if (!(zp = kmem_cache_alloc(osprd_zcache[0], GFP_ATOMIC)))
+		return -ENOMEM;
+	zp->index = index;
+	zp->fill = words[0];
+	zp->data = NULL;
+	zp->len = 0;
+	if (i < PAGE_SIZE / sizeof(long)) {
+		// Fails if the page does not fit the largest class.
+		start = osprd_now();
+		i = crypto_comp_compress(z->tfm, buf, PAGE_SIZE, z->out, &dlen);
+		osprd_stat_zip(d, 1, start);
+		if (i == 0) {
+			zp->data = kmem_cache_alloc(osprd_zcache[osprd_zclass(dlen)],
+						    GFP_ATOMIC);
+			zp->len = dlen;
+			from = z->out;
+		} else {
+			zp->data = (char *) __get_free_page(GFP_ATOMIC);
+			zp->len = PAGE_SIZE;
+			from = buf;
+		}
+		if (!zp->data) {
+			kmem_cache_free(osprd_zcache[0], zp);
+			return -ENOMEM;
+		}
+		memcpy(zp->data, from, zp->len);
+	}
+	*zpp = zp;
+	return 0;
+}
+
+/* osprd_zreplace(d, index, zp) puts zp at index in a compressed device's
+tree, or, if zp is NULL, removes what is there. The old page is freed once
+no reader can be using it. The caller holds the index's stripe seqlock.
+Returns 0, or -ENOMEM if a tree node could not be allocated, in which case
+zp is freed.															*/
+static int osprd_zreplace(osprd_info_t *d, unsigned long index,
+			  osprd_zpage_t *zp)
+{
+	osprd_zpage_t *old = NULL;
+	void **slot;
+	int r = 0;
+
+	osprd_write_lock_pages(d);
+	if ((slot = radix_tree_lookup_slot(&d->pages, index))) {
+		old = *slot;
+		if (zp)
+			*slot = zp;
+		else
+			radix_tree_delete(&d->pages, index);
+	} else if (zp)
+		r = radix_tree_insert(&d->pages, index, zp);
+	osprd_write_unlock_pages(d);
+
+	if (r < 0) {
+		osprd_zfree(zp);
+		return r;
+	}
+	if (old) {
+		osprd_zaccount(d, old, -1);
+		osprd_zfree(old);
+	}
+	if (zp)
+		osprd_zaccount(d, zp, 1);
+	return 0;
+}
+
+/* osprd_ztransfer(d, sector, nsect, buffer, write) is osprd_transfer for a
+compressed device. A write holds the page's stripe seqlock while it
+decompresses the old page (unless it overwrites the whole of it), changes
+it, compresses it and puts it in place of the old one. A page is never
+changed once it is in the tree, so a read just copies out or decompresses
+whatever it finds, under the tree's read lock, which also keeps the page
+from being freed meanwhile. Both use the CPU's stream, which is safe since
+requests are never served from interrupt context. Returns 0, -ENOMEM, or
+-EIO if a page does not decompress.										*/
+static int osprd_ztransfer(osprd_info_t *d, unsigned long sector,
+			   unsigned long nsect, char *buffer, int write)
+{
+	while (nsect > 0) {
+		unsigned long index = sector / OSPRD_PAGE_SECTORS;
+		unsigned long offset = (sector % OSPRD_PAGE_SECTORS) * SECTOR_SIZE;
+		unsigned long n = OSPRD_PAGE_SECTORS
+			- sector % OSPRD_PAGE_SECTORS;
+		seqlock_t *stripe = &d->stripe[index % OSPRD_NSTRIPES].lock;
+		osprd_zstream_t *z;
+		osprd_zpage_t *zp;
+		rwlock_t *pl;
+		int i, r = 0;
+
+		if (n > nsect)
+			n = nsect;
+		if (write) {
+			write_seqlock(stripe);
+			z = per_cpu_ptr(osprd_zstreams, smp_processor_id());
+			if (n < OSPRD_PAGE_SECTORS) {
+				pl = osprd_read_lock_pages(d);
+				zp = radix_tree_lookup(&d->pages, index);
+				r = osprd_zload(d, zp, z->page);
+				read_unlock(pl);
+			}
+			if (r == 0) {
+				memcpy(z->page + offset, buffer, n * SECTOR_SIZE);
+				r = osprd_zstore(d, z->page, index, &zp);
+			}
+			if (r == 0)
+				r = osprd_zreplace(d, index, zp);
+			write_sequnlock(stripe);
+		} else {
+			pl = osprd_read_lock_pages(d);
+			zp = radix_tree_lookup(&d->pages, index);
+			if (!zp || !zp->data)
+				for (i = 0; i < n * SECTOR_SIZE / sizeof(long); i++)
+					((unsigned long *) buffer)[i] =
+						zp ? zp->fill : 0;
+			else if (zp->len == PAGE_SIZE)
+				memcpy(buffer, zp->data + offset, n * SECTOR_SIZE);
+			else {
+				z = per_cpu_ptr(osprd_zstreams, smp_processor_id());
+				if ((r = osprd_zload(d, zp, z->page)) == 0)
+					memcpy(buffer, z->page + offset,
+					       n * SECTOR_SIZE);
+			}
+			read_unlock(pl);
+		}
+		if (r < 0)
+			return r;
+		sector += n;
+		nsect -= n;
+		buffer += n * SECTOR_SIZE;
+	}
+	return 0;
+}
+
+/* osprd_transfer(d, sector, nsect, buffer, write, gfp) copies nsect sectors
+starting at sector between buffer and the data pages, one page at a time.
+A write holds the page's stripe seqlock for its copy, first allocating the
+page if it was never written, or a private copy of it if a snapshot shares
+it (see osprd_unshare_page). A read takes no seqlock: it copies the page,
+or zeros for a page never written, and copies it again if a writer got in
+meanwhile, so readers never wait for each other or for the lock
+bookkeeping in osprd_ioctl, and wait for writers only on the pages they
+share. On a checksummed device a write stores its sectors' checksums with
+the data and a read checks them (see osprd_crcs_t). Returns 0, -ENOMEM if a
+page could not be allocated, or -EIO if a sector read fails its checksum.
+New pages and checksums are allocated with gfp, which the caller picks for
+the context it runs in. Compressed devices go through osprd_ztransfer
+instead, which allocates under a seqlock and so always atomically.			*/
+static int osprd_transfer(osprd_info_t *d, unsigned long sector,
+			  unsigned long nsect, char *buffer, int write,
+			  gfp_t gfp)
+{
+	u32 crcs[OSPRD_PAGE_SECTORS];
+	unsigned long crcs_sector = ~0UL;
+	osprd_crcs_t *page_crcs;
+	rwlock_t *pl;
+	int r;
+
+	if (d->compress)
+		return osprd_ztransfer(d, sector, nsect, buffer, write);
+
+	while (nsect > 0) {
+		unsigned long index = sector / OSPRD_PAGE_SECTORS;
+		unsigned long offset = (sector % OSPRD_PAGE_SECTORS) * SECTOR_SIZE;
+		unsigned long n = OSPRD_PAGE_SECTORS
+			- sector % OSPRD_PAGE_SECTORS;
+		seqlock_t *stripe = &d->stripe[index % OSPRD_NSTRIPES].lock;
+		struct page *page, *new_page = NULL;
+		unsigned seq;
+
+		if (n > nsect)
+			n = nsect;
+		if (write) {
+			osprd_crcs_t *new_crcs = NULL;
+			int done = 0;
+
+			// Checksum the data once, however often we retry.
+			if (d->checksum && crcs_sector != sector) {
+				osprd_crc32c((unsigned char *) buffer, n, crcs);
+				crcs_sector = sector;
+			}
+			// Allocate outside the seqlock, where we may sleep.
+			page = osprd_lookup_page(d, index);
+			if ((!page || osprd_page_shared(d, page))
+			    && !(new_page = alloc_page(gfp | __GFP_ZERO)))
+				return -ENOMEM;
+			if (d->checksum && !page
+			    && !(new_crcs = osprd_new_crcs(index, gfp))) {
+				__free_page(new_page);
+				return -ENOMEM;
+			}
+			write_seqlock(stripe);
+			pl = osprd_read_lock_pages(d);
+			page = radix_tree_lookup(&d->pages, index);
+			if (page && !osprd_page_shared(d, page)) {
+				memcpy(page_address(page) + offset, buffer,
+				       n * SECTOR_SIZE);
+				if (d->checksum
+				    && (page_crcs = radix_tree_lookup(&d->crcs,
+								      index)))
+					memcpy(page_crcs->crc
+					       + sector % OSPRD_PAGE_SECTORS,
+					       crcs, n * sizeof(u32));
+				done = 1;
+			}
+			read_unlock(pl);
+			if (!done && new_page) {
+				if (page) {
+					if (osprd_unshare_page(d, page,
+							       new_page, index))
+						new_page = NULL;
+				} else if (osprd_add_page(d, new_page, new_crcs,
+							  index) < 0) {
+					write_sequnlock(stripe);
+					__free_page(new_page);
+					kfree(new_crcs);
+					return -ENOMEM;
+				} else
+					new_page = new_crcs = NULL;
+			}
+			write_sequnlock(stripe);
+			if (new_page)
+				__free_page(new_page);
+			kfree(new_crcs);
+			// The page was missing or shared: write it now that
+			// we have our own, or allocate if that raced.
+			if (!done)
+				continue;
+		} else {
+			int checked;
+
+			do {
+				seq = read_seqbegin(stripe);
+				pl = osprd_read_lock_pages(d);
+				page = radix_tree_lookup(&d->pages, index);
+				if (page)
+					memcpy(buffer, page_address(page) + offset,
+					       n * SECTOR_SIZE);
+				else
+					memset(buffer, 0, n * SECTOR_SIZE);
+				page_crcs = d->checksum
+					? radix_tree_lookup(&d->crcs, index) : NULL;
+				if ((checked = page_crcs != NULL))
+					memcpy(crcs, page_crcs->crc
+					       + sector % OSPRD_PAGE_SECTORS,
+					       n * sizeof(u32));
+				read_unlock(pl);
+			} while (read_seqretry(stripe, seq));
+			// Checksum outside the locks, which writers wait for.
+			if (checked
+			    && (r = osprd_crc_check(d, sector, n, buffer, crcs)) < 0)
+				return r;
+		}
+		sector += n;
+		nsect -= n;
+		buffer += n * SECTOR_SIZE;
+	}
+	return 0;
+}
+
+/* osprd_put_pages(pages) empties a tree of data pages, dropping its
+reference to each; pages no snapshot shares are freed. Nobody else may be
+using the tree.															*/
+static void osprd_put_pages(struct radix_tree_root *pages)
+{
+	struct page *batch[16];
+	unsigned long index = 0;
+	int n, i;
+
+	while ((n = radix_tree_gang_lookup(pages, (void **) batch,
+					   index, 16)) > 0)
+		for (i = 0; i < n; i++) {
+			index = batch[i]->index + 1;
+			radix_tree_delete(pages, batch[i]->index);
+			put_page(batch[i]);
+		}
+}
+
+/* osprd_free_pages(d) frees every data page of the device, and their
+checksums.																	*/
+static void osprd_free_pages(osprd_info_t *d)
+{
+	osprd_zpage_t *batch[16];
+	unsigned long index = 0;
+	int n, i;
+
+	if (!d->compress)
+		osprd_put_pages(&d->pages);
+	else
+		while ((n = radix_tree_gang_lookup(&d->pages, (void **) batch,
+						   index, 16)) > 0)
+			for (i = 0; i < n; i++) {
+				index = batch[i]->index + 1;
+				radix_tree_delete(&d->pages, batch[i]->index);
+				osprd_zfree(batch[i]);
+			}
+	osprd_free_crcs(&d->crcs);
+	atomic_set(&d->nr_pages, 0);
+	atomic_long_set(&d->zbytes, 0);
+	atomic_set(&d->zsame, 0);
+}
+
+/* A device with a backing file keeps a bitmap of the pages written since
+ * they were last written to the file.  A write just sets its pages' bits;
+ * the flusher thread clears the bits and writes the pages out, in the
+ * background, waking up every OSPRD_FLUSH_INTERVAL or as soon as half of
+ * 'dirty_kb' is dirty.  Writes wait for it only once all of 'dirty_kb' is:
+ * with make_request=1 the writer sleeps in osprd_make_request; otherwise
+ * osprd_process_request_queue stops the queue, and the flusher starts it
+ * again.  A page's bit is cleared before its data is read for writing out,
+ * so a write that races with the flusher just sets it again. */
+#define OSPRD_FLUSH_INTERVAL	HZ
+
+/* osprd_npages(d) returns the number of pages d spans.					*/
+static unsigned long osprd_npages(osprd_info_t *d)
+{
+	return (d->nsectors + OSPRD_PAGE_SECTORS - 1) / OSPRD_PAGE_SECTORS;
+}
+
+/* osprd_dirty_limit() returns the number of dirty pages writes wait at.		*/
+static int osprd_dirty_limit(void)
+{
+	int limit = dirty_kb / (PAGE_SIZE / 1024);
+
+	return limit > 0 ? limit : 1;
+}
+
+/* osprd_dirty_full(d) returns nonzero if writes to d must wait for the
+flusher.																*/
+static int osprd_dirty_full(osprd_info_t *d)
+{
+	return d->dirty && atomic_read(&d->ndirty) >= osprd_dirty_limit();
+}
+
+/* osprd_mark_dirty(d, sector, nsect) notes that nsect sectors starting at
+sector have been changed and must be written to the backing file.		*/
+static void osprd_mark_dirty(osprd_info_t *d, unsigned long sector,
+			     unsigned long nsect)
+{
+	unsigned long index, last;
+
+	if (!d->dirty || nsect == 0)
+		return;
+	last = (sector + nsect - 1) / OSPRD_PAGE_SECTORS;
+	if (last >= d->dirty_npages)
+		last = d->dirty_npages - 1;
+	for (index = sector / OSPRD_PAGE_SECTORS; index <= last; index++)
+		if (!test_and_set_bit(index, d->dirty)
+		    && atomic_inc_return(&d->ndirty) == osprd_dirty_limit() / 2)
+			wake_up(&d->flushq);
+}
+
+/* osprd_flush_pages(d) writes every dirty page of d to its backing file.
+A page that fails its checksum is not written, so the file keeps the last
+copy that passed. The caller holds flush_mutex. Returns 0, or an error from
+the write, in which case the page stays dirty.							*/
+static int osprd_flush_pages(osprd_info_t *d)
+{
+	unsigned long npages = osprd_npages(d);
+	unsigned long index, nsect;
+	mm_segment_t old_fs;
+	loff_t pos;
+	ssize_t n;
+	int r = 0;
+
+	for (index = find_first_bit(d->dirty, npages); index < npages;
+	     index = find_next_bit(d->dirty, npages, index + 1)) {
+		if (!test_and_clear_bit(index, d->dirty))
+			continue;
+		atomic_dec(&d->ndirty);
+
+		nsect = d->nsectors - index * OSPRD_PAGE_SECTORS;
+		if (nsect > OSPRD_PAGE_SECTORS)
+			nsect = OSPRD_PAGE_SECTORS;
+		if ((r = osprd_transfer(d, index * OSPRD_PAGE_SECTORS, nsect,
+					d->flush_buf, 0, GFP_NOIO)) == 0) {
+			pos = (loff_t) index * PAGE_SIZE;
+			old_fs = get_fs();
+			set_fs(KERNEL_DS);
+			n = vfs_write(d->bfile, d->flush_buf,
+				      nsect * SECTOR_SIZE, &pos);
+			set_fs(old_fs);
+			if (n != nsect * SECTOR_SIZE)
+				r = n < 0 ? n : -EIO;
+		} else if (r == -EIO) {
+			// It failed its checksum: keep the file's good copy.
+			r = 0;
+			continue;
+		}
+		if (r < 0) {
+			if (!test_and_set_bit(index, d->dirty))
+				atomic_inc(&d->ndirty);
+			break;
+		}
+
+		// Let waiting writers go as soon as there is room.
+		if (!osprd_dirty_full(d))
+			wake_up(&d->cleanq);
+		cond_resched();
+	}
+	return r;
+}
+
+/* osprd_sync(d) writes every dirty page of d to its backing file and waits
+for the file to reach the disk, so that all writes to d completed before
+the call are stored. Returns 0 or an error.								*/
+static int osprd_sync(osprd_info_t *d)
+{
+	struct address_space *mapping;
+	int r, err;
+
+	if (!d->bfile)
+		return 0;
+	mapping = d->bfile->f_mapping;
+	mutex_lock(&d->flush_mutex);
+	if ((r = osprd_flush_pages(d)) == 0) {
+		r = filemap_fdatawrite(mapping);
+		if (d->bfile->f_op->fsync) {
+			mutex_lock(&mapping->host->i_mutex);
+			err = d->bfile->f_op->fsync(d->bfile,
+						    d->bfile->f_dentry, 0);
+			mutex_unlock(&mapping->host->i_mutex);
+			if (r == 0)
+				r = err;
+		}
+		err = filemap_fdatawait(mapping);
+		if (r == 0)
+			r = err;
+	}
+	mutex_unlock(&d->flush_mutex);
+	return r;
+}
+
+/* osprd_flush_wanted(d) is the flusher's reason to wake up early.			*/
+static int osprd_flush_wanted(osprd_info_t *d)
+{
+	return atomic_read(&d->ndirty) >= osprd_dirty_limit() / 2
+		|| blk_queue_stopped(d->queue) || kthread_should_stop();
+}
+
+/* osprd_flusher(data) is the flusher thread of device 'data'. Once it has
+written the dirty pages out, it restarts the queue if writes stopped it.	*/
+static int osprd_flusher(void *data)
+{
+	osprd_info_t *d = (osprd_info_t *) data;
+	request_queue_t *q = d->queue;
+	unsigned long flags;
+	int r;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible_timeout(d->flushq,
+						 osprd_flush_wanted(d),
+						 OSPRD_FLUSH_INTERVAL);
+		mutex_lock(&d->flush_mutex);
+		r = osprd_flush_pages(d);
+		mutex_unlock(&d->flush_mutex);
+		if (r < 0 && printk_ratelimit())
+			printk(KERN_WARNING "osprd: can't write %s: %d\n",
+			       d->gd->disk_name, r);
+		wake_up(&d->cleanq);
+		if (blk_queue_stopped(q) && !osprd_dirty_full(d)) {
+			spin_lock_irqsave(q->queue_lock, flags);
+			blk_start_queue(q);
+			spin_unlock_irqrestore(q->queue_lock, flags);
+		}
+	}
+	return 0;
+}
+
+/* osprd_load(d) reads d's data from its backing file, skipping pages of
+zeros, which need no memory. Returns 0 or an error.						*/
+static int osprd_load(osprd_info_t *d)
+{
+	unsigned long npages = osprd_npages(d);
+	unsigned long index, nsect, i;
+	mm_segment_t old_fs = get_fs();
+	loff_t pos = 0;
+	ssize_t n;
+	int r = 0;
+
+	set_fs(KERNEL_DS);
+	for (index = 0; index < npages && r == 0; index++) {
+		nsect = d->nsectors - index * OSPRD_PAGE_SECTORS;
+		if (nsect > OSPRD_PAGE_SECTORS)
+			nsect = OSPRD_PAGE_SECTORS;
+		if ((n = vfs_read(d->bfile, d->flush_buf,
+				  nsect * SECTOR_SIZE, &pos)) <= 0) {
+			r = n;
+			break;
+		}
+		if (n < nsect * SECTOR_SIZE) {
+			memset(d->flush_buf + n, 0, nsect * SECTOR_SIZE - n);
+			npages = index + 1;	// the file ends here
+		}
+		for (i = 0; i < n / sizeof(long); i++)
+			if (((unsigned long *) d->flush_buf)[i])
+				break;
+		if (i < n / sizeof(long))
+			r = osprd_transfer(d, index * OSPRD_PAGE_SECTORS,
+					   nsect, d->flush_buf, 1, GFP_KERNEL);
+		cond_resched();
+	}
+	set_fs(old_fs);
+	return r;
+}
+
+/* osprd_setup_backing(d, path) opens d's backing file, loads d's data from
+it and starts the flusher. Returns 0 or an error.						*/
+static int osprd_setup_backing(osprd_info_t *d, const char *path)
+{
+	size_t size = BITS_TO_LONGS(osprd_npages(d)) * sizeof(long);
+	int r;
+
+	init_waitqueue_head(&d->flushq);
+	init_waitqueue_head(&d->cleanq);
+	atomic_set(&d->ndirty, 0);
+	if (!(d->flush_buf = kmalloc(PAGE_SIZE, GFP_KERNEL)))
+		return -ENOMEM;
+
+	d->bfile = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if (IS_ERR(d->bfile)) {
+		r = PTR_ERR(d->bfile);
+		d->bfile = NULL;
+		return r;
+	}
+	if ((r = osprd_load(d)) < 0)
+		return r;
+
+	if (!(d->dirty = vmalloc(size)))
+		return -ENOMEM;
+	memset(d->dirty, 0, size);
+	d->dirty_npages = osprd_npages(d);
+	d->flusher = kthread_run(osprd_flusher, d, "osprd%c-flush",
+				 'a' + (int) (d - osprds));
+	if (IS_ERR(d->flusher)) {
+		r = PTR_ERR(d->flusher);
+		d->flusher = NULL;
+		return r;
+	}
+	return 0;
+}
+
+/* osprd_cleanup_backing(d) stops the flusher, writes out what is still
+dirty and closes the backing file. No I/O may reach d any more.			*/
+static void osprd_cleanup_backing(osprd_info_t *d)
+{
+	int r;
+
+	if (d->flusher)
+		kthread_stop(d->flusher);
+	if (d->bfile && d->dirty && (r = osprd_sync(d)) < 0)
+		printk(KERN_WARNING "osprd: can't write %s: %d\n",
+		       backing[d - osprds], r);
+	if (d->bfile)
+		filp_close(d->bfile, NULL);
+	vfree(d->dirty);
+	kfree(d->flush_buf);
+}
+
+/* osprd_discard(d, sector, nsect) forgets the data of nsect sectors starting
+at sector, so they read as zeros again. Pages wholly inside the range are
+removed from the tree and freed, with their checksums; the sectors of
+partly covered pages are zeroed with an ordinary write, which copies the
+page first if a snapshot shares it. Each page is removed under its stripe
+seqlock, just like a write, and is freed only once no reader can still be
+copying from it. Returns 0, or -ENOMEM if a shared page could not be
+copied.																	*/
+static int osprd_discard(osprd_info_t *d, unsigned long sector,
+			 unsigned long nsect)
+{
+	while (nsect > 0) {
+		unsigned long index = sector / OSPRD_PAGE_SECTORS;
+		unsigned long offset = (sector % OSPRD_PAGE_SECTORS) * SECTOR_SIZE;
+		unsigned long n = OSPRD_PAGE_SECTORS
+			- sector % OSPRD_PAGE_SECTORS;
+		seqlock_t *stripe = &d->stripe[index % OSPRD_NSTRIPES].lock;
+		struct page *page = NULL;
+		osprd_crcs_t *crcs = NULL;
+
+		if (n > nsect)
+			n = nsect;
+		if (n == OSPRD_PAGE_SECTORS && d->compress) {
+			write_seqlock(stripe);
+			osprd_zreplace(d, index, NULL);
+			write_sequnlock(stripe);
+		} else if (n == OSPRD_PAGE_SECTORS) {
+			// Readers copy under the tree's read lock, so once
+			// the page is out of the tree nobody is using it.
+			write_seqlock(stripe);
+			osprd_write_lock_pages(d);
+			page = radix_tree_delete(&d->pages, index);
+			crcs = radix_tree_delete(&d->crcs, index);
+			osprd_write_unlock_pages(d);
+			write_sequnlock(stripe);
+		} else if (osprd_lookup_page(d, index)
+			   && osprd_transfer(d, sector, n,
+					     page_address(ZERO_PAGE(0)) + offset,
+					     1, GFP_NOIO) < 0)
+			return -ENOMEM;
+		if (page) {
+			put_page(page);
+			atomic_dec(&d->nr_pages);
+		}
+		kfree(crcs);
+		sector += n;
+		nsect -= n;
+		cond_resched();
+	}
+	return 0;
+}
+
+/* osprd_copy_crcs(dst, src) copies the checksums in tree src into the empty
+tree dst. The caller keeps src from changing. Returns 0 or -ENOMEM.		*/
+static int osprd_copy_crcs(struct radix_tree_root *dst,
+			   struct radix_tree_root *src)
+{
+	osprd_crcs_t *batch[16], *crcs;
+	unsigned long index = 0;
+	int n, i, r = 0;
+
+	while (r == 0 && (n = radix_tree_gang_lookup(src, (void **) batch,
+						     index, 16)) > 0)
+		for (i = 0; i < n && r == 0; i++) {
+			index = batch[i]->index + 1;
+			if (!(crcs = kmalloc(sizeof(*crcs), GFP_ATOMIC)))
+				r = -ENOMEM;
+			else if ((r = radix_tree_insert(dst, batch[i]->index,
+							crcs)) < 0)
+				kfree(crcs);
+			else
+				memcpy(crcs, batch[i], sizeof(*crcs));
+		}
+	return r;
+}
+
+/* osprd_snapshot(d, origin) makes d a read-only snapshot of origin as it is
+now, or, if origin is NULL, an empty writable device again. d's old data is
+dropped. The new tree is built while origin is frozen by write-locking its
+tree, which waits for every data copy in progress and keeps new ones
+out; building it costs a reference and a tree slot per page, no copying.
+If both devices are checksummed, origin's checksums are copied too; a
+snapshot of a device without them is not checked. Then the new trees
+replace d's, whose readers are excluded the same way. Returns 0, or
+-ENOMEM if the trees could not be built.									*/
+static int osprd_snapshot(osprd_info_t *d, osprd_info_t *origin)
+{
+	struct radix_tree_root pages, old, crcs, old_crcs;
+	struct page *batch[16];
+	unsigned long index = 0;
+	int n, i, count = 0, r = 0;
+
+	INIT_RADIX_TREE(&pages, GFP_ATOMIC);
+	INIT_RADIX_TREE(&crcs, GFP_ATOMIC);
+	if (origin) {
+		osprd_write_lock_pages(origin);
+		while (r == 0
+		       && (n = radix_tree_gang_lookup(&origin->pages,
+						      (void **) batch,
+						      index, 16)) > 0)
+			for (i = 0; i < n && r == 0; i++) {
+				index = batch[i]->index + 1;
+				r = radix_tree_insert(&pages, batch[i]->index,
+						      batch[i]);
+				if (r == 0) {
+					get_page(batch[i]);
+					count++;
+				}
+			}
+		if (r == 0 && d->checksum && origin->checksum)
+			r = osprd_copy_crcs(&crcs, &origin->crcs);
+		osprd_write_unlock_pages(origin);
+		if (r < 0) {
+			osprd_put_pages(&pages);
+			osprd_free_crcs(&crcs);
+			return r;
+		}
+	}
+
+	osprd_write_lock_pages(d);
+	old = d->pages;
+	d->pages = pages;
+	old_crcs = d->crcs;
+	d->crcs = crcs;
+	d->origin = origin;
+	atomic_set(&d->nr_pages, count);
+	osprd_write_unlock_pages(d);
+	set_disk_ro(d->gd, origin != NULL);
+	osprd_put_pages(&old);
+	osprd_free_crcs(&old_crcs);
+	osprd_mark_dirty(d, 0, d->nsectors);
+	return 0;
+}
+
+/* osprd_truncate_backing(d, nsect) cuts d's backing file down to nsect
+sectors, so that the sectors a shrink cut off do not come back from the
+file at the next load or after a grow. The caller holds flush_mutex.
+Returns 0 or an error.														*/
+static int osprd_truncate_backing(osprd_info_t *d, unsigned long nsect)
+{
+	struct dentry *dentry = d->bfile->f_dentry;
+	struct iattr attr;
+	int r = 0;
+
+	attr.ia_valid = ATTR_SIZE;
+	attr.ia_size = (loff_t) nsect * SECTOR_SIZE;
+	mutex_lock(&dentry->d_inode->i_mutex);
+	if (i_size_read(dentry->d_inode) > attr.ia_size)
+		r = notify_change(dentry, &attr);
+	mutex_unlock(&dentry->d_inode->i_mutex);
+	return r;
+}
+
+/* osprd_resize(d, bdev, nsect) grows or shrinks d, whose block device is
+bdev, to nsect sectors while it is in use. A shrink first lowers the size
+that requests are checked against and then discards the sectors cut off,
+so their memory is freed and a later grow finds them zeroed; a grow
+discards any pages that requests racing with that left behind before it
+raises the size. The size changes under the mutex, which range locks are
+checked under. A shrink forgets the dirty pages cut off and truncates the
+backing file to match. A device with a backing file cannot grow past its
+size at load, which its dirty bitmap was made for. Returns 0, -EINVAL for
+a size of 0, -EROFS for a snapshot, -EFBIG, -ENOMEM, or an error from
+truncating the backing file.												*/
+static int osprd_resize(osprd_info_t *d, struct block_device *bdev,
+			unsigned long nsect)
+{
+	unsigned long old, first, index;
+	void *entry;
+	rwlock_t *pl;
+	int r = 0, err;
+
+	if (nsect == 0)
+		return -EINVAL;
+	if (d->origin)
+		return -EROFS;
+	if (d->dirty && (nsect + OSPRD_PAGE_SECTORS - 1) / OSPRD_PAGE_SECTORS
+	    > d->dirty_npages)
+		return -EFBIG;
+
+	mutex_lock(&d->flush_mutex);
+	old = d->nsectors;
+	if (nsect > old) {
+		first = (old + OSPRD_PAGE_SECTORS - 1) / OSPRD_PAGE_SECTORS;
+		pl = osprd_read_lock_pages(d);
+		if (radix_tree_gang_lookup(&d->pages, &entry, first, 1) == 0)
+			first = nsect;		// nothing there: skip the walk
+		read_unlock(pl);
+		if (first * OSPRD_PAGE_SECTORS < nsect)
+			r = osprd_discard(d, first * OSPRD_PAGE_SECTORS,
+					  nsect - first * OSPRD_PAGE_SECTORS);
+		if (r == 0) {
+			osp_spin_lock(&d->mutex);
+			d->nsectors = nsect;
+			osp_spin_unlock(&d->mutex);
+		}
+	} else if (nsect < old) {
+		osp_spin_lock(&d->mutex);
+		d->nsectors = nsect;
+		osp_spin_unlock(&d->mutex);
+		r = osprd_discard(d, nsect, old - nsect);
+		// Nothing beyond the end is written out any more.
+		for (index = osprd_npages(d); index < d->dirty_npages; index++)
+			if (test_and_clear_bit(index, d->dirty))
+				atomic_dec(&d->ndirty);
+		if (d->bfile && (err = osprd_truncate_backing(d, nsect)) < 0)
+			r = err;
+	}
+
+	if (r == 0 && nsect != old) {
+		set_capacity(d->gd, nsect);
+		mutex_lock(&bdev->bd_mutex);
+		bd_set_size(bdev, (loff_t) nsect * SECTOR_SIZE);
+		if (nsect < old)
+			truncate_inode_pages(bdev->bd_inode->i_mapping,
+					     (loff_t) nsect * SECTOR_SIZE);
+		mutex_unlock(&bdev->bd_mutex);
+	}
+	mutex_unlock(&d->flush_mutex);
+	return r;
+}
+
+/* osprd_dax_page(d, index, alloc) returns d's page at index with a
+reference the caller must put, or NULL if it was never written and
+'alloc' is 0. Otherwise a missing page is allocated, as osprd_transfer
+would; returns ERR_PTR(-ENOMEM) if it cannot be. Called in process context.	*/
+static struct page *osprd_dax_page(osprd_info_t *d, unsigned long index,
+				   int alloc)
+{
+	seqlock_t *stripe = &d->stripe[index % OSPRD_NSTRIPES].lock;
+	struct page *page, *new_page = NULL;
+	rwlock_t *pl;
+
+	// The reference keeps the page alive if osprd_discard drops it.
+	pl = osprd_read_lock_pages(d);
+	if ((page = radix_tree_lookup(&d->pages, index)))
+		get_page(page);
+	read_unlock(pl);
+	if (page || !alloc)
+		return page;
+
+	if (!(new_page = alloc_page(GFP_KERNEL | __GFP_ZERO)))
+		return ERR_PTR(-ENOMEM);
+	write_seqlock(stripe);
+	if (!(page = osprd_lookup_page(d, index))) {
+		if (osprd_add_page(d, new_page, NULL, index) < 0) {
+			write_sequnlock(stripe);
+			__free_page(new_page);
+			return ERR_PTR(-ENOMEM);
+		}
+		page = new_page;
+		new_page = NULL;
+	}
+	get_page(page);
+	write_sequnlock(stripe);
+	if (new_page)
+		__free_page(new_page);
+	return page;
+}
+
+/* osprd_dax_rw(d, buf, count, ppos, write) is read() or write() for a
+direct-access device. It copies between the user's buffer and the
+ramdisk's pages directly, a page at a time: one copy, where the page cache
+path takes two (user to cache, cache to ramdisk) and keeps the data in
+memory twice. Like a mapping, it takes no stripe seqlock for the copy,
+which may fault, so a read may see part of a concurrent write. Returns the
+bytes copied, or -EFAULT, -ENOMEM or -ENOSPC if none were.				*/
+static ssize_t osprd_dax_rw(osprd_info_t *d, char __user *buf, size_t count,
+			    loff_t *ppos, int write)
+{
+	loff_t pos = *ppos, size = (loff_t) d->nsectors * SECTOR_SIZE;
+	u64 start = osprd_now();
+	size_t done = 0;
+	ssize_t r = 0;
+
+	if (pos >= size)
+		return write && count ? -ENOSPC : 0;
+	if (count > size - pos)
+		count = size - pos;
+
+	while (done < count) {
+		unsigned long index = pos >> PAGE_SHIFT;
+		unsigned long offset = pos & ~PAGE_MASK;
+		size_t n = PAGE_SIZE - offset, left;
+		struct page *page;
+
+		if (n > count - done)
+			n = count - done;
+		page = osprd_dax_page(d, index, write);
+		if (IS_ERR(page)) {
+			r = PTR_ERR(page);
+			break;
+		}
+		if (write)
+			left = copy_from_user(page_address(page) + offset,
+					      buf + done, n);
+		else if (page)
+			left = copy_to_user(buf + done,
+					    page_address(page) + offset, n);
+		else
+			left = clear_user(buf + done, n);
+		if (page)
+			put_page(page);
+		if (write && n > left)
+			osprd_mark_dirty(d, pos / SECTOR_SIZE,
+					 (offset + n - left - 1) / SECTOR_SIZE
+					 - offset / SECTOR_SIZE + 1);
+		done += n - left;
+		pos += n - left;
+		if (left) {
+			r = -EFAULT;
+			break;
+		}
+		cond_resched();
+	}
+
+	*ppos = pos;
+	if (done)
+		osprd_stat_io(d, write, done, start);
+	return done ? done : r;
+}
+
+/* osprd_dax_nopage(vma, address, type) maps the ramdisk's page for a fault
+in a direct-access mapping, allocating it if it was never written. The
+mapping keeps the reference osprd_dax_page took.						*/
+static struct page *osprd_dax_nopage(struct vm_area_struct *vma,
+				     unsigned long address, int *type)
+{
+	osprd_info_t *d = file2osprd(vma->vm_file);
+	unsigned long index = ((address - vma->vm_start) >> PAGE_SHIFT)
+		+ vma->vm_pgoff;
+	struct page *page;
+
+	if (index >= osprd_npages(d))
+		return NOPAGE_SIGBUS;
+	page = osprd_dax_page(d, index, 1);
+	if (IS_ERR(page))
+		return NOPAGE_OOM;
+	if (type)
+		*type = VM_FAULT_MINOR;
+	return page;
+}
+
+static struct vm_operations_struct osprd_dax_vm_ops = {
+	.nopage = osprd_dax_nopage
+};
+
+/* osprd_dax_mmap(d, vma) sets up a mapping of a direct-access device. Stores
+through a mapping cannot be tracked for the flusher, so a device with a
+backing file can be mapped shared only read-only (from a read-only file).
+A page that OSPRDIOCDISCARD drops stays mapped until unmapped, but is no
+longer the device's.													*/
+static int osprd_dax_mmap(osprd_info_t *d, struct vm_area_struct *vma)
+{
+	if (d->bfile && (vma->vm_flags & (VM_SHARED | VM_MAYWRITE))
+	    == (VM_SHARED | VM_MAYWRITE))
+		return -EACCES;
+	vma->vm_ops = &osprd_dax_vm_ops;
+	vma->vm_flags |= VM_RESERVED;
+	return 0;
+}
+
+/* osprd_transfer_bio(d, bio) checks that the bio lies within the device,
+then reads or writes every one of its segments with osprd_transfer. With
+make_request=1 the segments are mapped with kmap, not kmap_atomic, so that
+osprd_transfer may sleep to allocate pages; the request function runs
+under the queue lock anyway. Returns 0 on success, -EIO if the bio is out
+of range, or -ENOMEM.														*/
+static int osprd_transfer_bio(osprd_info_t *d, struct bio *bio)
+{
+	struct bio_vec *bvec;
+	sector_t sector = bio->bi_sector;
+	int write = bio_data_dir(bio) == WRITE;
+	gfp_t gfp = make_request ? GFP_NOIO : GFP_ATOMIC;
+	int i;
+
+	if (sector + (bio->bi_size / SECTOR_SIZE) > d->nsectors)
+		return -EIO;
+	if (write && d->origin)		// snapshots are read-only
+		return -EROFS;
+	bio_for_each_segment(bvec, bio, i) {
+		char *buffer;
+		int r;
+
+		if (make_request)
+			buffer = kmap(bvec->bv_page) + bvec->bv_offset;
+		else
+			buffer = __bio_kmap_atomic(bio, i, KM_USER0);
+		r = osprd_transfer(d, sector, bvec->bv_len / SECTOR_SIZE,
+				   buffer, write, gfp);
+		if (make_request)
+			kunmap(bvec->bv_page);
+		else
+			__bio_kunmap_atomic(buffer, KM_USER0);
+		if (r < 0)
+			return r;
+		if (write)
+			osprd_mark_dirty(d, sector, bvec->bv_len / SECTOR_SIZE);
+		sector += bvec->bv_len / SECTOR_SIZE;
+	}
+	return 0;
+}
+
+/* osprd_emu_on(emu) returns nonzero if emu emulates anything.				*/
+static int osprd_emu_on(struct osprd_emulation *emu)
+{
+	return emu->latency_us || emu->jitter_us || emu->bandwidth_kb
+		|| emu->depth;
+}
+
+/* osprd_emu_reserve(d) is called before a request is transferred. Returns
+1 if d emulates a slower disk, so the request's completion must be delayed
+with osprd_emu_delay, and counts it against the depth; 0 if d does not; or
+-EAGAIN if d already has as many requests in flight as its depth allows, in
+which case the caller must wait for one to complete. A device that emulates
+nothing takes no lock here: a request that races with OSPRDIOCSETEMU is
+emulated or not, either way consistently.									*/
+static int osprd_emu_reserve(osprd_info_t *d)
+{
+	unsigned long flags;
+	int r = 1;
+
+	if (!osprd_emu_on(&d->emu))
+		return 0;
+	spin_lock_irqsave(&d->emu_lock, flags);
+	if (d->emu.depth && d->emu_inflight >= d->emu.depth) {
+		d->emu_held = 1;
+		r = -EAGAIN;
+	} else
+		d->emu_inflight++;
+	spin_unlock_irqrestore(&d->emu_lock, flags);
+	return r;
+}
+
+/* osprd_emu_jitter(d) draws a request's jitter in ns. The caller holds
+emu_lock. An exponential jitter is -ln(U) times the mean for U uniform in
+(0, 1), in 16.16 fixed point. log2(U) is the position of U's top bit plus
+log2(1 + f) for the 16 bits f after it, which f + 0.343 f (1 - f) matches
+to within 1%.																*/
+static u64 osprd_emu_jitter(osprd_info_t *d)
+{
+	unsigned x = d->emu_random;
+	u32 f, nlog2;
+	int b;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	d->emu_random = x;
+	if (!d->emu.jitter_exp)
+		return (((u64) d->emu.jitter_us * x) >> 32) * 1000;
+	b = fls(x);
+	f = (b > 17 ? x >> (b - 17) : x << (17 - b)) & 0xffff;
+	f += (f * (65536 - f) >> 16) * 22486 >> 16;
+	nlog2 = ((33 - b) << 16) - f;
+	return ((((u64) d->emu.jitter_us * nlog2) >> 16) * 45426 >> 16) * 1000;
+}
+
+/* osprd_emu_delay(d, req, bio, error, bytes, write, start) holds back the
+completion of a request, or with make_request=1 a bio, that was transferred
+after osprd_emu_reserve returned 1. It is due when the emulated disk would
+finish it, after moving the bytes of every request before it at its
+bandwidth, plus the latency and the jitter; the timer completes it then.
+Returns 0, or -ENOMEM if the caller must complete it now.					*/
+static int osprd_emu_delay(osprd_info_t *d, struct request *req,
+			   struct bio *bio, int error, unsigned long bytes,
+			   int write, u64 start)
+{
+	osprd_delayed_t *e = kmem_cache_alloc(osprd_delayed_cache, GFP_ATOMIC);
+	struct list_head *pos;
+	unsigned long flags;
+	u64 now = osprd_now(), xfer;
+
+	spin_lock_irqsave(&d->emu_lock, flags);
+	if (!e) {
+		d->emu_inflight--;
+		spin_unlock_irqrestore(&d->emu_lock, flags);
+		wake_up(&d->emuq);
+		return -ENOMEM;
+	}
+	e->req = req;
+	e->bio = bio;
+	e->error = error;
+	e->write = write;
+	e->bytes = bytes;
+	e->start = start;
+	e->due = now;
+	if (d->emu.bandwidth_kb) {
+		xfer = ((u64) bytes * 1000000000) >> 10;
+		do_div(xfer, d->emu.bandwidth_kb);
+		if (d->emu_free > now)
+			e->due = d->emu_free;
+		e->due += xfer;
+		d->emu_free = e->due;
+	}
+	e->due += (u64) d->emu.latency_us * 1000 + osprd_emu_jitter(d);
+
+	// Jitter aside, requests come due in order: look from the back.
+	list_for_each_prev(pos, &d->emu_list)
+		if (list_entry(pos, osprd_delayed_t, link)->due <= e->due)
+			break;
+	list_add(&e->link, pos);
+	if (d->emu_list.next == &e->link)
+		hrtimer_start(&d->emu_timer, ns_to_ktime(e->due), HRTIMER_ABS);
+	spin_unlock_irqrestore(&d->emu_lock, flags);
+	return 0;
+}
+
+/* osprd_emu_end(d, e) completes a delayed request or bio.					*/
+static void osprd_emu_end(osprd_info_t *d, osprd_delayed_t *e)
+{
+	unsigned long flags;
+
+	if (e->req) {
+		spin_lock_irqsave(d->queue->queue_lock, flags);
+		end_that_request_first(e->req, !e->error,
+				       e->req->hard_nr_sectors);
+		end_that_request_last(e->req, !e->error);
+		spin_unlock_irqrestore(d->queue->queue_lock, flags);
+	} else
+		bio_endio(e->bio, e->bytes, e->error);
+	osprd_stat_io(d, e->write, e->bytes, e->start);
+	kmem_cache_free(osprd_delayed_cache, e);
+}
+
+/* osprd_emu_release(d) lets submitters that found the emulated disk full
+try again: those waiting in osprd_emu_reserve's caller, or the request
+function.																	*/
+static void osprd_emu_release(osprd_info_t *d)
+{
+	unsigned long flags;
+	int held;
+
+	spin_lock_irqsave(&d->emu_lock, flags);
+	held = d->emu_held;
+	d->emu_held = 0;
+	spin_unlock_irqrestore(&d->emu_lock, flags);
+	wake_up(&d->emuq);
+	if (held && !make_request)
+		blk_run_queue(d->queue);
+}
+
+/* osprd_emu_complete(d, all) completes the delayed requests that are due,
+or all of them, and sets the timer for the next one.						*/
+static void osprd_emu_complete(osprd_info_t *d, int all)
+{
+	LIST_HEAD(done);
+	osprd_delayed_t *e, *next;
+	unsigned long flags;
+	u64 now = osprd_now();
+
+	spin_lock_irqsave(&d->emu_lock, flags);
+	list_for_each_entry_safe(e, next, &d->emu_list, link) {
+		if (!all && e->due > now)
+			break;
+		list_move_tail(&e->link, &done);
+		d->emu_inflight--;
+	}
+	if (!list_empty(&d->emu_list))
+		hrtimer_start(&d->emu_timer,
+			      ns_to_ktime(list_entry(d->emu_list.next,
+						     osprd_delayed_t, link)->due),
+			      HRTIMER_ABS);
+	spin_unlock_irqrestore(&d->emu_lock, flags);
+
+	list_for_each_entry_safe(e, next, &done, link)
+		osprd_emu_end(d, e);
+	osprd_emu_release(d);
+}
+
+/* osprd_emu_work(d) completes d's requests that are due, for its timer.
+It runs from kblockd, in process context, so that restarting the request
+function never serves requests from softirq context, where they could
+spin on a data lock that the interrupted task holds.						*/
+static void osprd_emu_work(void *d)
+{
+	osprd_emu_complete((osprd_info_t *) d, 0);
+}
+
+/* osprd_emu_timer(timer) is the function of a device's emu_timer. It runs
+in softirq context, so it just leaves the work to osprd_emu_work.			*/
+static int osprd_emu_timer(struct hrtimer *timer)
+{
+	kblockd_schedule_work(&container_of(timer, osprd_info_t,
+					    emu_timer)->emu_work);
+	return HRTIMER_NORESTART;
+}
+
+/* osprd_set_emu(d, emu) changes the slower disk that d emulates. Requests
+already delayed keep their due times.										*/
+static void osprd_set_emu(osprd_info_t *d, struct osprd_emulation *emu)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&d->emu_lock, flags);
+	d->emu = *emu;
+	spin_unlock_irqrestore(&d->emu_lock, flags);
+	osprd_emu_release(d);
+}
+
+/* osprd_process_request(d, req, delay) transfers every segment of every bio
+in the request and then completes the whole request at once, rather than one
+segment per trip through the request queue; or, if 'delay' is set because
+d emulates a slower disk, leaves completing it to the timer.				*/
+static void osprd_process_request(osprd_info_t *d, struct request *req,
+				  int delay)
+{
+	struct bio *bio;
+	int uptodate = 1;
+	unsigned long bytes = req->hard_nr_sectors * SECTOR_SIZE;
+	u64 start = osprd_now();
+
+	if (!blk_fs_request(req)) {
+		end_request(req, 0);
+		return;
+	}
+
+	rq_for_each_bio(bio, req)
+		if (osprd_transfer_bio(d, bio) < 0)
+			uptodate = 0;
+	blkdev_dequeue_request(req);
+	if (delay && osprd_emu_delay(d, req, NULL, uptodate ? 0 : -EIO, bytes,
+				     rq_data_dir(req) == WRITE, start) == 0)
+		return;
+	end_that_request_first(req, uptodate, req->hard_nr_sectors);
+	end_that_request_last(req, uptodate);
+	osprd_stat_io(d, rq_data_dir(req) == WRITE, bytes, start);
+}
+
+/* osprd_make_request(q, bio) is the request function when make_request=1.
+A RAM disk gains nothing from merging or sorting, so each bio is transferred
+and completed right away, without going through the elevator, unless d
+emulates a slower disk. A write waits first if too much is waiting to be
+written to the backing file, and any bio waits while the emulated disk has
+as many requests in flight as its depth allows.							*/
+static int osprd_make_request(request_queue_t *rq, struct bio *bio)
+{
+	osprd_info_t *d = (osprd_info_t *) rq->queuedata;
+	unsigned long bytes = bio->bi_size;
+	int write = bio_data_dir(bio) == WRITE;
+	u64 start = osprd_now();
+	int r, delay;
+
+	if (write && osprd_dirty_full(d)) {
+		wake_up(&d->flushq);
+		wait_event(d->cleanq, !osprd_dirty_full(d));
+	}
+	wait_event(d->emuq, (delay = osprd_emu_reserve(d)) >= 0);
+	r = osprd_transfer_bio(d, bio);
+
+	if (delay && osprd_emu_delay(d, NULL, bio, r, bytes, write, start) == 0)
+		return 0;
+	bio_endio(bio, bytes, r);
+	osprd_stat_io(d, write, bytes, start);
+	return 0;
+}
+
+
+// This function is called when a /dev/osprdX file is opened.
+// You aren't likely to need to change this.
+static int osprd_open(struct inode *inode, struct file *filp)
+{
+	osprd_info_t *d = file2osprd(filp);
+
+	// Set the O_SYNC flag, unless the device is in write-back mode. That
+	// way, we will get writes immediately instead of waiting for them to
+	// get through write-back caches.
+	if (!writeback[d - osprds])
+		filp->f_flags |= O_SYNC;
+	if (!(filp->private_data = kzalloc(sizeof(osprd_file_t), GFP_KERNEL)))
+		return -ENOMEM;
+	return 0;
+}
+
+
+/* osprd_lock_free(d, write) says whether a read (or, if write, a write) lock
+could be granted right now. The caller holds the mutex.						*/
+static int osprd_lock_free(osprd_info_t *d, int write)
+{
+	return d->num_writers == 0 && !d->upgrader
+		&& (!write || d->num_readers == 0);
+}
+
+/* osprd_hold(d, filp, write, pid, since) records that pid now holds a read
+or write lock through filp, after waiting since 'since' (0 if it did not
+wait). The caller holds the mutex.										*/
+static void osprd_hold(osprd_info_t *d, struct file *filp, int write,
+		       pid_t pid, u64 since)
+{
+	osprd_stat_locked(d, filp, write, since);
+	if (write) {
+		d->num_writers++;
+		d->curr_writer = pid;
+		filp->f_flags |= F_OSPRD_LOCKED | F_OSPRD_WRITELOCK;
+	} else {
+		d->num_readers++;
+		filp->f_flags |= F_OSPRD_LOCKED;
+	}
+}
+
+/* osprd_grant(d) hands the lock to waiters from the head of the queue for as
+long as they can have it: one writer, or every reader up to the next writer.
+Only those waiters are woken, each with its own wake_up_process; the rest
+of the queue sleeps on. A pending upgrade (see osprd_upgrade) goes before
+the whole queue, which waits until it is done. The caller holds the mutex.	*/
+static void osprd_grant(osprd_info_t *d)
+{
+	osprd_waiter_t *w;
+	int queued = 0;
+
+	if ((w = d->upgrader)) {
+		if (d->num_readers != 1 || d->num_writers != 0)
+			return;
+		d->upgrader = NULL;
+		d->num_readers--;
+		osprd_stat_unlocked(d, w->filp, 0);
+		osprd_hold(d, w->filp, 1, w->pid, w->since);
+		w->granted = 1;
+		wake_up_process(w->task);
+		osprd_stat_count(d, wakeups);
+		return;
+	}
+
+	while (!list_empty(&d->waiters)) {
+		w = list_entry(d->waiters.next, osprd_waiter_t, link);
+		if (!osprd_lock_free(d, w->write))
+			break;
+		list_del(&w->link);
+		osprd_hold(d, w->filp, w->write, w->pid, w->since);
+		w->granted = 1;
+		if (w->task)
+			wake_up_process(w->task);
+		else
+			queued = 1;
+		osprd_stat_count(d, wakeups);
+	}
+	if (queued)
+		wake_up_interruptible(&d->pollq);
+}
+
+/* osprd_acquire(d, filp, write, timeout) blocks until filp holds a read or
+write lock on the device. The lock is granted in FIFO order: a request that
+finds the lock busy, or other tasks already waiting, joins the tail of
+'waiters' and sleeps until osprd_grant hands it the lock, so a writer is
+never starved by a stream of later readers. A signal, or the end of the
+timeout (in jiffies; MAX_SCHEDULE_TIMEOUT waits forever), takes the waiter
+out of the queue, which costs O(1), and lets whoever it was holding up go
+first. If the lock is busy and timeout is 0, it fails at once, and to keep
+the queue fair it does so even if the lock is free but others are waiting.
+Returns 0, -EBUSY, -ETIMEDOUT, or -ERESTARTSYS if interrupted.			*/
+static int osprd_acquire(osprd_info_t *d, struct file *filp, int write,
+			 long timeout)
+{
+	osprd_waiter_t w;
+	int r = 0;
+
+	osp_spin_lock(&d->mutex);
+	if (list_empty(&d->waiters) && osprd_lock_free(d, write))
+		osprd_hold(d, filp, write, current->pid, 0);
+	else if (timeout == 0)
+		r = -EBUSY;
+	else {
+		w.task = current;
+		w.pid = current->pid;
+		w.filp = filp;
+		w.since = osprd_now();
+		w.write = write;
+		w.granted = 0;
+		list_add_tail(&w.link, &d->waiters);
+		for (;;) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (w.granted)
+				break;
+			if (signal_pending(current))
+				r = -ERESTARTSYS;
+			else if (timeout == 0)
+				r = -ETIMEDOUT;
+			if (r < 0) {
+				list_del(&w.link);
+				osprd_grant(d);
+				osprd_stat_count(d, cancels);
+				break;
+			}
+			osp_spin_unlock(&d->mutex);
+			timeout = schedule_timeout(timeout);
+			osp_spin_lock(&d->mutex);
+		}
+		__set_current_state(TASK_RUNNING);
+	}
+	osp_spin_unlock(&d->mutex);
+	return r;
+}
+
+/* osprd_queue(d, filp, write) queues filp for a lock without waiting for it.
+The waiter is allocated and hung off filp's osprd_file_t; osprd_grant sets
+F_OSPRD_LOCKED when it is granted and wakes the device's pollers, so the
+caller can wait in poll() (see osprd_poll). Returns 0, -EALREADY if filp
+already holds or has queued for the lock, or -ENOMEM.					*/
+static int osprd_queue(osprd_info_t *d, struct file *filp, int write)
+{
+	osprd_waiter_t *w = kmalloc(sizeof(*w), GFP_KERNEL);
+
+	if (!w)
+		return -ENOMEM;
+	w->task = NULL;
+	w->pid = current->pid;
+	w->filp = filp;
+	w->since = osprd_now();
+	w->write = write;
+	w->granted = 0;
+
+	osp_spin_lock(&d->mutex);
+	if ((filp->f_flags & F_OSPRD_LOCKED) || osprd_file(filp)->queued) {
+		osp_spin_unlock(&d->mutex);
+		kfree(w);
+		return -EALREADY;
+	}
+	osprd_file(filp)->queued = w;
+	list_add_tail(&w->link, &d->waiters);
+	osprd_grant(d);
+	osp_spin_unlock(&d->mutex);
+	return 0;
+}
+
+/* osprd_release(d, filp) drops the lock filp holds and passes it on to the
+waiters that can now have it. If filp only queued for the lock, its request
+is cancelled instead. Returns 0, or -EINVAL if filp holds no lock.		*/
+static int osprd_release(osprd_info_t *d, struct file *filp)
+{
+	osprd_waiter_t *w;
+
+	osp_spin_lock(&d->mutex);
+	if ((w = osprd_file(filp)->queued)) {
+		osprd_file(filp)->queued = NULL;
+		if (!w->granted) {
+			list_del(&w->link);
+			osprd_grant(d);
+			osprd_stat_count(d, cancels);
+			osp_spin_unlock(&d->mutex);
+			kfree(w);
+			return 0;
+		}
+		kfree(w);
+	}
+	if (!(filp->f_flags & F_OSPRD_LOCKED)) {
+		osp_spin_unlock(&d->mutex);
+		return -EINVAL;
+	}
+	osprd_stat_unlocked(d, filp, (filp->f_flags & F_OSPRD_WRITELOCK) != 0);
+	if (filp->f_flags & F_OSPRD_WRITELOCK) {
+		d->num_writers--;
+		d->curr_writer = -1;
+	} else
+		d->num_readers--;
+	filp->f_flags &= ~(F_OSPRD_LOCKED | F_OSPRD_WRITELOCK);
+	osprd_grant(d);
+	osp_spin_unlock(&d->mutex);
+	return 0;
+}
+
+
+/* Per-CPU reader mode.  On a device loaded with percpu=1 (see above), a
+ * reader's lock is normally just an increment of a per-CPU counter, so
+ * readers on different CPUs share no cache lines and never take the
+ * mutex.  A writer pays instead: it raises 'pcpu_writers', which sends new
+ * readers to the ordinary queue, waits in synchronize_sched() until every
+ * reader that missed it has finished its increment, takes the queued lock,
+ * and then waits for the per-CPU counts to drain to zero.  A reader may
+ * release on another CPU than it acquired on, so only the counts' sum is
+ * meaningful. */
+
+/* osprd_percpu_readers(d) returns the number of fast-path readers.			*/
+static int osprd_percpu_readers(osprd_info_t *d)
+{
+	int cpu, n = 0;
+
+	for_each_possible_cpu(cpu)
+		n += *per_cpu_ptr(d->pcpu_readers, cpu);
+	return n;
+}
+
+/* osprd_percpu_read_lock(d, filp) takes a fast-path read lock for filp and
+returns 1, or returns 0 if a writer is pending.							*/
+static int osprd_percpu_read_lock(osprd_info_t *d, struct file *filp)
+{
+	preempt_disable();
+	if (atomic_read(&d->pcpu_writers) != 0) {
+		preempt_enable();
+		return 0;
+	}
+	(*per_cpu_ptr(d->pcpu_readers, smp_processor_id()))++;
+	preempt_enable();
+	filp->f_flags |= F_OSPRD_LOCKED | F_OSPRD_PERCPU;
+	osprd_stat_locked(d, filp, 0, 0);
+	return 1;
+}
+
+/* osprd_lock(d, filp, write, timeout) gives filp a read or write lock on the
+device, using the per-CPU fast path if the device has one. It waits as
+osprd_acquire does, and returns what it returns. In per-CPU mode the
+timeout also bounds a writer's wait for readers to drain.				*/
+static int osprd_lock(osprd_info_t *d, struct file *filp, int write,
+		      long timeout)
+{
+	unsigned long deadline = jiffies + timeout;
+	long left;
+	int r;
+
+	if (!d->pcpu_readers)
+		return osprd_acquire(d, filp, write, timeout);
+	if (!write)
+		return osprd_percpu_read_lock(d, filp) ? 0
+			: osprd_acquire(d, filp, 0, timeout);
+
+	atomic_inc(&d->pcpu_writers);
+	synchronize_sched();
+	if ((r = osprd_acquire(d, filp, 1, timeout)) == 0) {
+		if (timeout == 0)
+			left = osprd_percpu_readers(d) == 0;
+		else {
+			if (timeout == MAX_SCHEDULE_TIMEOUT)
+				left = MAX_SCHEDULE_TIMEOUT;
+			else if (time_before(jiffies, deadline))
+				left = deadline - jiffies;
+			else
+				left = 1;
+			left = wait_event_interruptible_timeout(d->pcpu_drain,
+					osprd_percpu_readers(d) == 0, left);
+		}
+		if (left <= 0) {
+			r = left < 0 ? left : timeout ? -ETIMEDOUT : -EBUSY;
+			osprd_release(d, filp);
+		}
+	}
+	if (r < 0)
+		atomic_dec(&d->pcpu_writers);
+	return r;
+}
+
+/* osprd_lock_queued(d, filp, write) is osprd_lock for osprd_queue: it queues
+filp for the lock and returns without waiting.							*/
+static int osprd_lock_queued(osprd_info_t *d, struct file *filp, int write)
+{
+	int r;
+
+	if (!d->pcpu_readers)
+		return osprd_queue(d, filp, write);
+	if (!write && !(filp->f_flags & F_OSPRD_LOCKED) && !osprd_file(filp)->queued
+	    && osprd_percpu_read_lock(d, filp))
+		return 0;
+	if (write) {
+		atomic_inc(&d->pcpu_writers);
+		synchronize_sched();
+	}
+	if ((r = osprd_queue(d, filp, write)) < 0 && write)
+		atomic_dec(&d->pcpu_writers);
+	return r;
+}
+
+/* osprd_unlock(d, filp) releases the lock filp holds, however it was taken.
+A fast-path reader wakes a draining writer if there is one.				*/
+static int osprd_unlock(osprd_info_t *d, struct file *filp)
+{
+	osprd_waiter_t *w = osprd_file(filp)->queued;
+	int write = (filp->f_flags & F_OSPRD_WRITELOCK) || (w && w->write);
+	int r;
+
+	if (filp->f_flags & F_OSPRD_PERCPU) {
+		osprd_stat_unlocked(d, filp, 0);
+		filp->f_flags &= ~(F_OSPRD_LOCKED | F_OSPRD_PERCPU);
+		preempt_disable();
+		(*per_cpu_ptr(d->pcpu_readers, smp_processor_id()))--;
+		preempt_enable();
+		smp_mb();	// pairs with the writer's wait_event
+		if (atomic_read(&d->pcpu_writers))
+			wake_up(&d->pcpu_drain);
+		return 0;
+	}
+	r = osprd_release(d, filp);
+	if (r == 0 && d->pcpu_readers && write)
+		atomic_dec(&d->pcpu_writers);
+	return r;
+}
+
+/* osprd_downgrade(d, filp) turns filp's write lock into a read lock without
+letting go of it, and grants the lock to any readers at the head of the
+queue; a writer there keeps waiting. Returns 0, or -EINVAL if filp holds no
+write lock.																*/
+static int osprd_downgrade(osprd_info_t *d, struct file *filp)
+{
+	osp_spin_lock(&d->mutex);
+	if (!(filp->f_flags & F_OSPRD_WRITELOCK)) {
+		osp_spin_unlock(&d->mutex);
+		return -EINVAL;
+	}
+	osprd_stat_unlocked(d, filp, 1);
+	d->num_writers--;
+	d->curr_writer = -1;
+	d->num_readers++;
+	filp->f_flags &= ~F_OSPRD_WRITELOCK;
+	osprd_stat_locked(d, filp, 0, 0);
+	osprd_grant(d);
+	osp_spin_unlock(&d->mutex);
+	return 0;
+}
+
+/* osprd_upgrade(d, filp) turns filp's read lock into a write lock without
+letting go of it. The upgrade goes ahead of every queued request and waits
+only for the other current readers to finish. Only one upgrade can be
+pending: if two readers both waited to upgrade, each would wait for the
+other forever, so the second fails at once with -EDEADLK, still holding
+its read lock. Returns 0, -EBADF if filp is not open for writing, -EINVAL
+if it holds no read lock, -EDEADLK, or -ERESTARTSYS if interrupted, in
+which case filp still holds its read lock.								*/
+static int osprd_upgrade(osprd_info_t *d, struct file *filp)
+{
+	osprd_waiter_t w;
+	int r = 0;
+
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if ((filp->f_flags & (F_OSPRD_LOCKED | F_OSPRD_WRITELOCK))
+	    != F_OSPRD_LOCKED)
+		return -EINVAL;
+	if (d->pcpu_readers) {
+		// Like any writer in per-CPU mode; see osprd_lock.
+		atomic_inc(&d->pcpu_writers);
+		synchronize_sched();
+	}
 
-	unsigned ticket_tail;		// Next available ticket for
-					// the device lock
+	osp_spin_lock(&d->mutex);
+	if (filp->f_flags & F_OSPRD_PERCPU) {
+		// Trade the fast-path read lock for an ordinary one.
+		(*per_cpu_ptr(d->pcpu_readers, smp_processor_id()))--;
+		d->num_readers++;
+		filp->f_flags &= ~F_OSPRD_PERCPU;
+	}
+	if (d->upgrader)
+		r = -EDEADLK;
+	else if (d->num_readers == 1) {
+		d->num_readers--;
+		osprd_stat_unlocked(d, filp, 0);
+		osprd_hold(d, filp, 1, current->pid, 0);
+	} else {
+		w.task = current;
+		w.pid = current->pid;
+		w.filp = filp;
+		w.since = osprd_now();
+		w.write = 1;
+		w.granted = 0;
+		d->upgrader = &w;
+		for (;;) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (w.granted)
+				break;
+			if (signal_pending(current)) {
+				r = -ERESTARTSYS;
+				d->upgrader = NULL;
+				osprd_grant(d);
+				osprd_stat_count(d, cancels);
+				break;
+			}
+			osp_spin_unlock(&d->mutex);
+			schedule();
+			osp_spin_lock(&d->mutex);
+		}
+		__set_current_state(TASK_RUNNING);
+	}
+	osp_spin_unlock(&d->mutex);
+
+	if (d->pcpu_readers && r == 0
+	    && (r = wait_event_interruptible(d->pcpu_drain,
+					     osprd_percpu_readers(d) == 0)) < 0)
+		osprd_downgrade(d, filp);
+	if (d->pcpu_readers && r < 0)
+		atomic_dec(&d->pcpu_writers);
+	return r;
+}
 
-	wait_queue_head_t blockq;       // Wait queue for tasks blocked on
-					// the device lock
+/* Range locks.  OSPRDIOCACQUIRERANGE locks just the sectors [start, start +
+ * len) of the device, so writers on disjoint parts of a device need not
+ * serialize.  Every request, waiting or granted, is an osprd_range_lock_t
+ * in the device's 'ranges' interval tree, and takes a ticket when it
+ * arrives.  A request may proceed once no overlapping request with an
+ * earlier ticket conflicts with it (two reads never conflict).  So
+ * overlapping requests are served in arrival order, a writer is never
+ * starved by later readers, and waits only ever point at earlier tickets,
+ * which rules out deadlock between different files.
+ *
+ * Range locks are independent of the whole-device lock, as fcntl and flock
+ * locks are on a file: a program should use one kind or the other. */
+
+/* The tree is a red-black tree sorted by 'start', in which each node also
+ * keeps the largest 'end' in its subtree, so a search can skip subtrees
+ * that end before the range it is looking for.  This kernel's rbtree has
+ * no augmented-tree support, so osprd_range_fixup follows the same
+ * approach as later kernels' rb_augment_insert and rb_augment_erase: after
+ * a rebalance, recompute 'max_end' on the path up from the deepest node
+ * the rotations could have changed, and on that path's siblings. */
+
+/* osprd_range_max(n) recomputes n's subtree 'max_end' from its children.	*/
+static void osprd_range_max(struct rb_node *n)
+{
+	osprd_range_lock_t *rl = rb_entry(n, osprd_range_lock_t, node);
+	sector_t max = rl->end;
+
+	if (n->rb_left && rb_entry(n->rb_left, osprd_range_lock_t,
+				   node)->max_end > max)
+		max = rb_entry(n->rb_left, osprd_range_lock_t, node)->max_end;
+	if (n->rb_right && rb_entry(n->rb_right, osprd_range_lock_t,
+				    node)->max_end > max)
+		max = rb_entry(n->rb_right, osprd_range_lock_t, node)->max_end;
+	rl->max_end = max;
+}
 
-	pid_t curr_writer;
+/* osprd_range_fixup(n) recomputes 'max_end' from n up to the root.		*/
+static void osprd_range_fixup(struct rb_node *n)
+{
+	struct rb_node *parent;
+
+	for (; n; n = parent) {
+		osprd_range_max(n);
+		if (!(parent = rb_parent(n)))
+			break;
+		if (n == parent->rb_left && parent->rb_right)
+			osprd_range_max(parent->rb_right);
+		else if (n == parent->rb_right && parent->rb_left)
+			osprd_range_max(parent->rb_left);
+	}
+}
 
-	int num_readers;
+/* osprd_range_insert(d, rl) adds rl to the device's tree.				*/
+static void osprd_range_insert(osprd_info_t *d, osprd_range_lock_t *rl)
+{
+	struct rb_node **p = &d->ranges.rb_node, *parent = NULL;
 
-	int num_writers;
+	while (*p) {
+		parent = *p;
+		if (rl->start < rb_entry(parent, osprd_range_lock_t,
+					 node)->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rl->max_end = rl->end;
+	rb_link_node(&rl->node, parent, p);
+	rb_insert_color(&rl->node, &d->ranges);
+	osprd_range_fixup(rl->node.rb_left ? rl->node.rb_left
+			  : rl->node.rb_right ? rl->node.rb_right : &rl->node);
+}
 
-	unsigned* bad_tickets;
+/* osprd_range_erase(d, rl) takes rl out of the device's tree.				*/
+static void osprd_range_erase(osprd_info_t *d, osprd_range_lock_t *rl)
+{
+	struct rb_node *n = &rl->node, *deepest;
+
+	// Find the deepest node whose subtree the erase changes.
+	if (!n->rb_left && !n->rb_right)
+		deepest = rb_parent(n);
+	else if (!n->rb_right)
+		deepest = n->rb_left;
+	else if (!n->rb_left)
+		deepest = n->rb_right;
+	else {
+		deepest = rb_next(n);
+		if (deepest->rb_right)
+			deepest = deepest->rb_right;
+		else if (rb_parent(deepest) != n)
+			deepest = rb_parent(deepest);
+	}
+	rb_erase(n, &d->ranges);
+	osprd_range_fixup(deepest);
+}
 
-	int num_bad_tickets;
+/* osprd_range_visit(n, start, end, fn, data) calls fn(rl, data) for every
+lock in n's subtree that overlaps [start, end), in order of 'start', until
+fn returns nonzero. Returns what fn last returned.						*/
+static int osprd_range_visit(struct rb_node *n, sector_t start, sector_t end,
+			     int (*fn)(osprd_range_lock_t *rl, void *data),
+			     void *data)
+{
+	osprd_range_lock_t *rl;
+	int r;
 
-	// The following elements are used internally; you don't need
-	// to understand them.
-	struct request_queue *queue;    // The device request queue.
-	spinlock_t qlock;		// Used internally for mutual
-	                                //   exclusion in the 'queue'.
-	struct gendisk *gd;             // The generic disk.
-} osprd_info_t;
+	if (!n || (rl = rb_entry(n, osprd_range_lock_t, node))->max_end <= start)
+		return 0;
+	if ((r = osprd_range_visit(n->rb_left, start, end, fn, data)))
+		return r;
+	if (rl->start >= end)
+		return 0;
+	if (rl->end > start && (r = fn(rl, data)))
+		return r;
+	return osprd_range_visit(n->rb_right, start, end, fn, data);
+}
 
-#define NOSPRD 4
-static osprd_info_t osprds[NOSPRD];
+/* The state of a search for locks that block a request.					*/
+typedef struct osprd_range_search {
+	osprd_range_lock_t *rl;		// The request
+	int blocked;			// Does anything block it?
+	int deadlock;			// Would its own file's locks?
+} osprd_range_search_t;
 
+/* osprd_range_blocks(other, data) checks whether 'other' blocks the request
+being searched for: it does if it came first and one of the two writes.	*/
+static int osprd_range_blocks(osprd_range_lock_t *other, void *data)
+{
+	osprd_range_search_t *s = (osprd_range_search_t *) data;
+	osprd_range_lock_t *rl = s->rl;
 
-// Declare useful helper functions
+	if (other == rl || other->ticket > rl->ticket
+	    || (!other->write && !rl->write))
+		return 0;
+	s->blocked = 1;
+	if (other->granted && other->filp == rl->filp) {
+		s->deadlock = 1;
+		return 1;
+	}
+	return 0;
+}
 
-/*
- * file2osprd(filp)
- *   Given an open file, check whether that file corresponds to an OSP ramdisk.
- *   If so, return a pointer to the ramdisk's osprd_info_t.
- *   If not, return NULL.
- */
-static osprd_info_t *file2osprd(struct file *filp);
+/* osprd_range_blocked(d, rl) returns 0 if rl may proceed, 1 if it must wait,
+or -EDEADLK if it would wait for a lock its own file holds.				*/
+static int osprd_range_blocked(osprd_info_t *d, osprd_range_lock_t *rl)
+{
+	osprd_range_search_t s = { rl, 0, 0 };
 
-/*
- * for_each_open_file(task, callback, user_data)
- *   Given a task, call the function 'callback' once for each of 'task's open
- *   files.  'callback' is called as 'callback(filp, user_data)'; 'filp' is
- *   the open file, and 'user_data' is copied from for_each_open_file's third
- *   argument.
- */
-static void for_each_open_file(struct task_struct *task,
-			       void (*callback)(struct file *filp,
-						osprd_info_t *user_data),
-			       osprd_info_t *user_data);
+	osprd_range_visit(d->ranges.rb_node, rl->start, rl->end,
+			  osprd_range_blocks, &s);
+	return s.deadlock ? -EDEADLK : s.blocked;
+}
 
+/* osprd_range_wake(rl, data) grants a waiting request if nothing blocks it
+any more, and wakes only its task.										*/
+static int osprd_range_wake(osprd_range_lock_t *rl, void *data)
+{
+	osprd_info_t *d = (osprd_info_t *) data;
 
-/*
- * osprd_process_request(d, req)
- *   Called when the user reads or writes a sector.
- *   Should perform the read or write, as appropriate.
- */
+	if (!rl->granted && osprd_range_blocked(d, rl) == 0) {
+		rl->granted = 1;
+		wake_up_process(rl->task);
+		osprd_stat_count(d, wakeups);
+	}
+	return 0;
+}
 
-/* osprd_process_request(d, req) first calculates the appropriate offset and 
-sector size from the struct request argument. Then it checks the argument again
-to determine what kind of request (read or write) and either reads or writes
-the osprdX files using memcpy. We added a spin lock to prevent osprdX being
-written to simultaneously or being written and read simutaneously			*/
-static void osprd_process_request(osprd_info_t *d, struct request *req)
+/* osprd_range_remove(d, rl) takes rl out of the tree and grants the waiting
+requests that only it was holding up. The caller holds the mutex.		*/
+static void osprd_range_remove(osprd_info_t *d, osprd_range_lock_t *rl)
 {
-	if (!blk_fs_request(req)) {
-		end_request(req, 0);
-		return;
-	}
+	osprd_range_erase(d, rl);
+	osprd_range_visit(d->ranges.rb_node, rl->start, rl->end,
+			  osprd_range_wake, d);
+}
 
-	int offset = req->sector*SECTOR_SIZE;
-	int size = req->current_nr_sectors*SECTOR_SIZE;
-	if (rq_data_dir(req) == READ) 
-	{
-		osp_spin_lock(&(d->mutex));
-		memcpy(req->buffer, d->data + offset, size);
-		osp_spin_unlock(&(d->mutex));
+/* osprd_range_acquire(d, filp, range, write, block) locks the sector range
+for filp, for writing or reading. If the range is busy it sleeps until the
+lock is granted, or, if !block, returns -EBUSY. Returns 0, -EBUSY, -EDEADLK
+if filp itself holds a conflicting lock, -EINVAL for a bad range,
+-ENOMEM, or -ERESTARTSYS if interrupted.								*/
+static int osprd_range_acquire(osprd_info_t *d, struct file *filp,
+			       struct osprd_range *range, int write, int block)
+{
+	osprd_range_lock_t *rl;
+	int r;
+
+	if (range->nsectors == 0)
+		return -EINVAL;
+	if (!(rl = kmalloc(sizeof(*rl), GFP_KERNEL)))
+		return -ENOMEM;
+	rl->start = range->sector;
+	rl->end = range->sector + range->nsectors;
+	rl->write = write;
+	rl->filp = filp;
+	rl->task = current;
+	rl->granted = 0;
+
+	// osprd_resize changes the size under the mutex.
+	osp_spin_lock(&d->mutex);
+	if (range->sector >= d->nsectors
+	    || range->nsectors > d->nsectors - range->sector) {
+		osp_spin_unlock(&d->mutex);
+		kfree(rl);
+		return -EINVAL;
 	}
-	else if (rq_data_dir(req) == WRITE)
-	{
-		osp_spin_lock(&(d->mutex));
-		memcpy(d->data + offset, req->buffer, size);
-		osp_spin_unlock(&(d->mutex));
+	rl->ticket = d->range_ticket++;
+	osprd_range_insert(d, rl);
+	if ((r = osprd_range_blocked(d, rl)) == 0)
+		rl->granted = 1;
+	else if (r > 0 && !block)
+		r = -EBUSY;
+	else if (r > 0) {
+		for (r = 0; ; ) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (rl->granted)
+				break;
+			if (signal_pending(current)) {
+				r = -ERESTARTSYS;
+				break;
+			}
+			osp_spin_unlock(&d->mutex);
+			schedule();
+			osp_spin_lock(&d->mutex);
+		}
+		__set_current_state(TASK_RUNNING);
 	}
-	end_request(req, 1);
+	if (r < 0)
+		osprd_range_remove(d, rl);
+	osp_spin_unlock(&d->mutex);
+	if (r < 0)
+		kfree(rl);
+	return r;
 }
 
+/* The state of a search for a file's range lock.							*/
+typedef struct osprd_range_find {
+	struct file *filp;
+	struct osprd_range *range;	// The range, or NULL to match any
+	osprd_range_lock_t *found;
+} osprd_range_find_t;
 
-// This function is called when a /dev/osprdX file is opened.
-// You aren't likely to need to change this.
-static int osprd_open(struct inode *inode, struct file *filp)
+static int osprd_range_match(osprd_range_lock_t *rl, void *data)
 {
-	// Always set the O_SYNC flag. That way, we will get writes immediately
-	// instead of waiting for them to get through write-back caches.
-	filp->f_flags |= O_SYNC;
-	return 0;
+	osprd_range_find_t *f = (osprd_range_find_t *) data;
+
+	if (rl->filp != f->filp || !rl->granted
+	    || (f->range && (rl->start != f->range->sector
+			     || rl->end - rl->start != f->range->nsectors)))
+		return 0;
+	f->found = rl;
+	return 1;
+}
+
+/* osprd_range_release(d, filp, range) drops filp's lock on exactly that
+range; if range is NULL, it drops every range lock filp holds, including
+any past the end of a device that shrank since. Returns 0, or -EINVAL if
+there was no such lock.													*/
+static int osprd_range_release(osprd_info_t *d, struct file *filp,
+			       struct osprd_range *range)
+{
+	osprd_range_find_t f = { filp, range, NULL };
+	sector_t start = range ? range->sector : 0;
+	sector_t end;
+	int r = -EINVAL;
+
+	osp_spin_lock(&d->mutex);
+	if (range)
+		end = range->sector + range->nsectors;
+	else if (d->ranges.rb_node)	// The root knows the largest end.
+		end = rb_entry(d->ranges.rb_node, osprd_range_lock_t,
+			       node)->max_end;
+	else
+		end = 0;
+	while (osprd_range_visit(d->ranges.rb_node, start, end,
+				 osprd_range_match, &f)) {
+		osprd_range_remove(d, f.found);
+		kfree(f.found);
+		r = 0;
+		if (range)
+			break;
+	}
+	osp_spin_unlock(&d->mutex);
+	return r;
 }
 
 
@@ -157,47 +2808,113 @@ static int osprd_open(struct inode *inode, struct file *filp)
 // (If the file descriptor was dup2ed, this function is called only when the
 // last copy is closed.)
 
-/* osprd_close_last(inode,filp) first locks the mutex and proceeds with looking
-at the whether filp is open for writing. We remove the writers if it is or we 
-attempt to remove writer if it isn't. We remove the locks if the file holds a 
-lock as well. Lastly, wake up all of the blocked processes	and unlock mutex	 */
+/* osprd_close_last(inode,filp) releases any locks filp still holds or has
+queued for.																*/
 static int osprd_close_last(struct inode *inode, struct file *filp)
 {
 	if (filp) {
 		osprd_info_t *d = file2osprd(filp);
-		int filp_writable = filp->f_mode & FMODE_WRITE;
-
-		osp_spin_lock(&(d->mutex));
-		if (filp_writable)
-		{ 
-			if (filp->f_flags & F_OSPRD_LOCKED && d->num_writers != 0)
-			{
-				filp->f_flags &= ~F_OSPRD_LOCKED;
-			}
-			d->num_writers = 0;
-			d->curr_writer = -1;
+
+		if ((filp->f_flags & F_OSPRD_LOCKED) || osprd_file(filp)->queued)
+			osprd_unlock(d, filp);
+		osprd_range_release(d, filp, NULL);
+		kfree(filp->private_data);
+		filp->private_data = NULL;
+	}
+	return 0;
+}
+
+
+/* osprd_lock_many(ubatch) locks the OSP ramdisks behind several open files
+in one go: each file gets a read or a write lock on its device, as listed
+in the user's struct osprd_lock_batch. The locks are always taken in device
+order, whatever order they are listed in, so two batches can never
+deadlock against each other. Either all the locks are taken or none are:
+if one cannot be had (with 'try', if it is busy), the ones already taken
+are released. Returns 0, -EBADF for a file that is not an OSP ramdisk or
+is asked for a write lock without being open for writing, -EINVAL if a
+device is listed twice or there are too many, -EALREADY if a file already
+holds or has queued for its lock, -EBUSY, -EFAULT or -ERESTARTSYS.		*/
+static int osprd_lock_many(struct osprd_lock_batch __user *ubatch)
+{
+	struct osprd_lock_batch batch;
+	struct osprd_lock_request req[NOSPRD];
+	osprd_info_t *devs[NOSPRD];
+	struct file *files[NOSPRD];
+	int writes[NOSPRD];
+	int i, j, n = 0, r = 0;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (batch.nlocks > NOSPRD)
+		return -EINVAL;
+	if (copy_from_user(req, (void __user *) batch.locks,
+			   batch.nlocks * sizeof(req[0])))
+		return -EFAULT;
+
+	// Look up the files, sorting them by device.
+	for (i = 0; i < batch.nlocks && r == 0; i++) {
+		struct file *f = fget(req[i].fd);
+		osprd_info_t *dev = file2osprd(f);
+
+		if (!f) {
+			r = -EBADF;
+			break;
 		}
-		else
-		{         
-			if (filp->f_flags && d->num_readers != 0)
-			{
-				d->num_readers--;
-			}
-			if (d->num_readers == 0)
-			{ 
-				filp->f_flags &= ~F_OSPRD_LOCKED;
-			}
+		for (j = n; j > 0 && devs[j - 1] > dev; j--) {
+			devs[j] = devs[j - 1];
+			files[j] = files[j - 1];
+			writes[j] = writes[j - 1];
 		}
-		wake_up_all(&(d->blockq));
-		osp_spin_unlock(&(d->mutex));
+		devs[j] = dev;
+		files[j] = f;
+		writes[j] = req[i].write != 0;
+		n++;
+		if (!dev || (writes[j] && !(f->f_mode & FMODE_WRITE)))
+			r = -EBADF;
+		else if ((j > 0 && devs[j - 1] == dev)
+			 || (j + 1 < n && devs[j + 1] == dev))
+			r = -EINVAL;
+		else if ((f->f_flags & F_OSPRD_LOCKED) || osprd_file(f)->queued)
+			r = -EALREADY;
 	}
-	return 0;
+
+	// Lock them in order; if one fails, unlock the ones before it.
+	for (i = 0; i < n && r == 0; i++)
+		r = osprd_lock(devs[i], files[i], writes[i],
+			       batch.try ? 0 : MAX_SCHEDULE_TIMEOUT);
+	if (r < 0)
+		for (i -= 2; i >= 0; i--)
+			osprd_unlock(devs[i], files[i]);
+
+	for (i = 0; i < n; i++)
+		fput(files[i]);
+	return r;
 }
 
 
-/*
- * osprd_lock
- */
+/* osprd_poll(filp, wait) lets an event loop wait for a lock it queued for
+with OSPRDIOCQUEUEACQUIRE. While that request is pending, the file polls
+as not ready; once the lock is granted (and, for a writer in per-CPU mode,
+the readers have drained), or if nothing is queued, it polls as usual.	*/
+static unsigned int osprd_poll(struct file *filp, poll_table *wait)
+{
+	osprd_info_t *d = file2osprd(filp);
+	osprd_waiter_t *w;
+	unsigned int mask = DEFAULT_POLLMASK;
+
+	poll_wait(filp, &d->pollq, wait);
+	if (d->pcpu_readers)
+		poll_wait(filp, &d->pcpu_drain, wait);
+	osp_spin_lock(&d->mutex);
+	if ((w = osprd_file(filp)->queued)
+	    && (!w->granted || (d->pcpu_readers && w->write
+				&& osprd_percpu_readers(d) != 0)))
+		mask = 0;
+	osp_spin_unlock(&d->mutex);
+	return mask;
+}
+
 
 /*
  * osprd_ioctl(inode, filp, cmd, arg)
@@ -212,143 +2929,182 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 	// is file open for writing?
 	int filp_writable = (filp->f_mode & FMODE_WRITE) != 0;
 
-	// This line avoids compiler warnings; you may remove it.
-	(void) filp_writable, (void) d;
-
 	// Set 'r' to the ioctl's return value: 0 on success, negative on error
 
-	/* We start by creating a ticket for the lock request so we can process
-	in the correct order. Then we check if we are getting a write lock or read
-	lock. If it is a write lock, we wait until no other process has lock and 
-	then actually create the lock and invalidating the ticket. If it is a read
-	lock, we also check if other processes have lock and then process the read 
-	lock in similar fashion. Afterwards, we move to the next ticket in order, 
-	checking for invalid tickets. Spin locks are used when we work with 
-	ticket_head and ticket_tail and when we assign the locks				 */
-	if (cmd == OSPRDIOCACQUIRE) {
-
-		osp_spin_lock(&(d->mutex));
-		unsigned ticket = d->ticket_head;
-		d->ticket_head++;
-		osp_spin_unlock(&(d->mutex));
-		if (filp_writable)
-		{
-			if (wait_event_interruptible(d->blockq, d->num_readers == 0 && d->num_writers == 0 && d->ticket_tail == ticket) == -ERESTARTSYS)
-			{
-				osp_spin_lock(&(d->mutex));
-				if (d->ticket_tail == ticket)
-				{
-					d->ticket_tail++;
-				}
-				else
-				{
-					d->bad_tickets[d->num_bad_tickets++] = ticket;
-					d->num_bad_tickets++;
-				}
-				osp_spin_unlock(&(d->mutex));
-				return -ERESTARTSYS;
-			}
-			osp_spin_lock(&(d->mutex));
-			d->num_writers++;
-			d->curr_writer = current->pid;
-			filp->f_flags |= F_OSPRD_LOCKED;
-			osp_spin_unlock(&(d->mutex));
-		}
+	/* A file open for writing takes a write lock, otherwise a read lock.
+	Waiters are served in order; see osprd_acquire and osprd_lock.		*/
+	if (cmd == OSPRDIOCACQUIRE)
+		r = osprd_lock(d, filp, filp_writable, MAX_SCHEDULE_TIMEOUT);
+
+	/* The same, but return -EBUSY instead of blocking.					*/
+	else if (cmd == OSPRDIOCTRYACQUIRE)
+		r = osprd_lock(d, filp, filp_writable, 0);
+
+	/* The same, but give up with -ETIMEDOUT after 'arg' milliseconds. Like
+	other timed waits, an interrupted one is not restarted.				*/
+	else if (cmd == OSPRDIOCACQUIRETIMEOUT) {
+		unsigned long timeout = msecs_to_jiffies(arg);
+
+		if (timeout >= MAX_SCHEDULE_TIMEOUT)
+			timeout = MAX_SCHEDULE_TIMEOUT - 1;
+		r = osprd_lock(d, filp, filp_writable, timeout);
+		if (r == -EBUSY)
+			r = -ETIMEDOUT;
+		else if (r == -ERESTARTSYS)
+			r = -EINTR;
+	}
+
+	/* Queue for the lock without waiting; poll() says when it is ours.
+	OSPRDIOCRELEASE cancels the request if it is still waiting.			*/
+	else if (cmd == OSPRDIOCQUEUEACQUIRE)
+		r = osprd_lock_queued(d, filp, filp_writable);
+
+	/* Drop the file's lock and wake the waiters it was holding up.		*/
+	else if (cmd == OSPRDIOCRELEASE)
+		r = osprd_unlock(d, filp);
+
+	/* Turn a read lock into a write lock, or back, without releasing it.	*/
+	else if (cmd == OSPRDIOCUPGRADE)
+		r = osprd_upgrade(d, filp);
+	else if (cmd == OSPRDIOCDOWNGRADE) {
+		if ((r = osprd_downgrade(d, filp)) == 0 && d->pcpu_readers)
+			atomic_dec(&d->pcpu_writers);
+	}
+
+	/* Lock several devices at once, all or nothing; see osprd_lock_many.
+	Each lock is released through its own file as usual.				*/
+	else if (cmd == OSPRDIOCACQUIREMANY)
+		r = osprd_lock_many((struct osprd_lock_batch __user *) arg);
+
+	/* Zero the device's statistics in /proc/osprd, which are everyone's,
+	so only for a writer or the administrator.							*/
+	else if (cmd == OSPRDIOCRESETSTATS) {
+		int cpu;
+
+		if (!filp_writable && !capable(CAP_SYS_ADMIN))
+			return -EBADF;
+		for_each_possible_cpu(cpu)
+			memset(per_cpu_ptr(d->stats, cpu), 0,
+			       sizeof(osprd_stats_t));
+	}
+
+	/* Lock or unlock just a range of sectors; see osprd_range_acquire.	*/
+	else if (cmd == OSPRDIOCACQUIRERANGE || cmd == OSPRDIOCTRYACQUIRERANGE
+		 || cmd == OSPRDIOCRELEASERANGE) {
+
+		struct osprd_range range;
+
+		if (copy_from_user(&range, (void __user *) arg, sizeof(range)))
+			return -EFAULT;
+		if (cmd == OSPRDIOCRELEASERANGE)
+			r = osprd_range_release(d, filp, &range);
 		else
-		{      
-			if (wait_event_interruptible(d->blockq, (d->num_writers == 0 && d->ticket_tail == ticket)) == -ERESTARTSYS)
-			{
-				osp_spin_lock(&(d->mutex));
-				if (d->ticket_tail == ticket)
-				{
-					d->ticket_tail++;
-				}
-				else
-				{
-					d->bad_tickets[d->num_bad_tickets++] = ticket;
-					d->num_bad_tickets++;
-				}
-				osp_spin_unlock(&(d->mutex));
-				return -ERESTARTSYS;
-			}
-			osp_spin_lock(&(d->mutex));
-			d->num_readers++;
-			filp->f_flags |= F_OSPRD_LOCKED;
-			osp_spin_unlock(&(d->mutex));
-		}
-		osp_spin_lock(&(d->mutex));
-		d->ticket_tail++;
-		int i;
-		for(i = 0; i<d->num_bad_tickets; i++)
-		{
-			if (d->bad_tickets[i] == d->ticket_tail)
-			{
-				d->ticket_tail++;
-				d->bad_tickets[i] = d->bad_tickets[d->num_bad_tickets];
-				d->num_bad_tickets--;
-				i = 0;
-			}
-		}
-		osp_spin_unlock(&(d->mutex));
-
-	/* This case is the same as OSPRDIOCACQUIRE but without blocking. First 
-	check if the request is for write or read lock. Then the lock is assigned 
-	if there is no block, otherwise, just return EBUSY signal. */
-	} else if (cmd == OSPRDIOCTRYACQUIRE) {
-
-		osp_spin_lock(&(d->mutex));
-		if (filp_writable)
-		{
-			if (d->num_readers == 0 && d->num_writers == 0)
-			{
-				d->num_writers++;
-				d->curr_writer = current->pid;
-				filp->f_flags |= F_OSPRD_LOCKED;
-			}
+			r = osprd_range_acquire(d, filp, &range, filp_writable,
+						cmd == OSPRDIOCACQUIRERANGE);
+	}
+
+	/* Drop a range of sectors and give their pages back to the system.
+	Dirty cached blocks of the range are written first, so they cannot
+	land on the device after the discard; then the range is discarded
+	and its cached blocks are dropped, so later reads see zeros.		*/
+	else if (cmd == OSPRDIOCDISCARD) {
+
+		struct osprd_range range;
+		loff_t start, end;
+
+		if (!filp_writable)
+			return -EBADF;
+		if (copy_from_user(&range, (void __user *) arg, sizeof(range)))
+			return -EFAULT;
+		if (range.sector > d->nsectors
+		    || range.nsectors > d->nsectors - range.sector)
+			return -EINVAL;
+		if (range.nsectors == 0)
+			return 0;
+		start = range.sector * SECTOR_SIZE;
+		end = (range.sector + range.nsectors) * SECTOR_SIZE - 1;
+		if (d->origin)
+			return -EROFS;
+		if ((r = filemap_write_and_wait(filp->f_mapping)) < 0)
+			return r;
+		r = osprd_discard(d, range.sector, range.nsectors);
+		osprd_mark_dirty(d, range.sector, range.nsectors);
+		invalidate_mapping_pages(filp->f_mapping,
+					 start >> PAGE_CACHE_SHIFT,
+					 end >> PAGE_CACHE_SHIFT);
+	}
+
+	/* Make this device a read-only snapshot of the device open on file
+	descriptor 'arg', which must be the same size, or, if 'arg' is -1, a
+	writable empty device again; see osprd_snapshot. The origin's dirty cached writes go in first,
+	and whatever was cached of this device's old data is dropped.		*/
+	else if (cmd == OSPRDIOCSNAPSHOT) {
+
+		struct file *f = NULL;
+		osprd_info_t *origin = NULL;
+
+		if (!filp_writable)
+			return -EBADF;
+		if ((int) arg != -1) {
+			if (!(f = fget(arg)))
+				return -EBADF;
+			if (!(origin = file2osprd(f)))
+				r = -EBADF;
+			else if (origin == d || d->compress || origin->compress
+				 || d->dax || origin->dax
+				 || d->nsectors != origin->nsectors)
+				r = -EINVAL;
 			else
-			{
-				osp_spin_unlock(&(d->mutex));
-				return -EBUSY;
-			}
+				r = filemap_write_and_wait(f->f_mapping);
 		}
+		if (r == 0 && (r = osprd_snapshot(d, origin)) == 0)
+			invalidate_mapping_pages(filp->f_mapping, 0, ~0UL);
+		if (f)
+			fput(f);
+	}
+
+	/* Switch this file between O_SYNC (arg 1) and writing back through the
+	page cache (arg 0). Writes cached so far reach the ramdisk first.	*/
+	else if (cmd == OSPRDIOCSETSYNC) {
+		if ((r = filemap_write_and_wait(filp->f_mapping)) < 0)
+			return r;
+		// The lock flags share f_flags and change under the mutex.
+		osp_spin_lock(&d->mutex);
+		if (arg)
+			filp->f_flags |= O_SYNC;
 		else
-		{   
-			if (d->num_writers == 0)
-			{
-				d->num_readers++;
-				filp->f_flags |= F_OSPRD_LOCKED;
-			}
-			else
-			{
-				osp_spin_unlock(&(d->mutex));
-				return -EBUSY;
-			}
-		}
-		osp_spin_unlock(&(d->mutex));
+			filp->f_flags &= ~O_SYNC;
+		osp_spin_unlock(&d->mutex);
+	}
 
-	/* If the file did not lock the ramdisk, just return. Otherwise, it determines
-	if writers or reader needs to be removed and unlocks the ramdisk. All blocked
-	processes are woken as well													*/
-	} else if (cmd == OSPRDIOCRELEASE) {
+	/* Write the page cache's dirty data to the ramdisk and wait for it.	*/
+	else if (cmd == OSPRDIOCFLUSH)
+		r = filemap_write_and_wait(filp->f_mapping);
 
-		osp_spin_lock(&(d->mutex));
-		if (!(filp->f_flags & F_OSPRD_LOCKED)) {
-			return -EINVAL;
-		}
-		if (filp_writable) {    
-			d->num_writers = 0;
-			filp->f_flags &= ~F_OSPRD_LOCKED;
-		}
-		else
-		{        
-			d->num_readers--;
-			if (d->num_readers == 0)
-			{
-				filp->f_flags &= ~F_OSPRD_LOCKED;
-			}
-		}
-		wake_up_all(&(d->blockq));
-		osp_spin_unlock(&(d->mutex));
+	/* Grow or shrink the device to 'arg' sectors; see osprd_resize.		*/
+	else if (cmd == OSPRDIOCRESIZE) {
+		if (!filp_writable)
+			return -EBADF;
+		r = osprd_resize(d, inode->i_bdev, arg);
+	}
+
+	/* Emulate a slower disk, or with all zeros stop; see osprd_emu_delay. */
+	else if (cmd == OSPRDIOCSETEMU) {
+		struct osprd_emulation emu;
+
+		if (!filp_writable)
+			return -EBADF;
+		if (copy_from_user(&emu, (void __user *) arg, sizeof(emu)))
+			return -EFAULT;
+		emu.jitter_exp = emu.jitter_exp != 0;
+		osprd_set_emu(d, &emu);
+	}
+
+	/* Wait until every write completed so far is stored in the backing
+	file; see osprd_sync.												*/
+	else if (cmd == OSPRDIOCSYNC) {
+		if ((r = filemap_write_and_wait(filp->f_mapping)) == 0)
+			r = osprd_sync(d);
 	} else
 		r = -ENOTTY; /* unknown command */
 	return r;
@@ -359,14 +3115,28 @@ int osprd_ioctl(struct inode *inode, struct file *filp,
 
 static void osprd_setup(osprd_info_t *d)
 {
-	/* Initialize the wait queue. */
-	init_waitqueue_head(&d->blockq);
+	int i;
+
+	/* Initialize the lock queue. */
+	INIT_LIST_HEAD(&d->waiters);
+	d->upgrader = NULL;
+	init_waitqueue_head(&d->pollq);
+	d->ranges = RB_ROOT;
+	d->range_ticket = 0;
+	atomic_set(&d->pcpu_writers, 0);
+	init_waitqueue_head(&d->pcpu_drain);
+	for (i = 0; i < OSPRD_NSTRIPES; i++)
+		seqlock_init(&d->stripe[i].lock);
 	osp_spin_lock_init(&d->mutex);
-	d->ticket_head = d->ticket_tail = 0;
+	mutex_init(&d->flush_mutex);
+	spin_lock_init(&d->emu_lock);
+	INIT_LIST_HEAD(&d->emu_list);
+	hrtimer_init(&d->emu_timer, CLOCK_MONOTONIC, HRTIMER_ABS);
+	d->emu_timer.function = osprd_emu_timer;
+	INIT_WORK(&d->emu_work, osprd_emu_work, d);
+	init_waitqueue_head(&d->emuq);
 	d->num_writers = 0;
 	d->num_readers = 0;
-	d->bad_tickets = (unsigned*)kmalloc(1024 * sizeof(unsigned), GFP_ATOMIC);
-	d->num_bad_tickets = 0;
 	d->curr_writer = -1;
 }
 
@@ -383,9 +3153,22 @@ static void osprd_process_request_queue(request_queue_t *q)
 {
 	osprd_info_t *d = (osprd_info_t *) q->queuedata;
 	struct request *req;
-
-	while ((req = elv_next_request(q)) != NULL)
-		osprd_process_request(d, req);
+	int delay;
+
+	while ((req = elv_next_request(q)) != NULL) {
+		// Too much unwritten: the flusher will start us again.
+		if (rq_data_dir(req) == WRITE && osprd_dirty_full(d)) {
+			blk_stop_queue(q);
+			wake_up(&d->flushq);
+			break;
+		}
+		// The emulated disk is full: its timer runs us again.
+		delay = 0;
+		if (blk_fs_request(req)
+		    && (delay = osprd_emu_reserve(d)) < 0)
+			break;
+		osprd_process_request(d, req, delay);
+	}
 }
 
 
@@ -403,12 +3186,66 @@ static int _osprd_release(struct inode *inode, struct file *filp)
 	return (*blkdev_release)(inode, filp);
 }
 
+static int (*blkdev_fsync)(struct file *, struct dentry *, int);
+
+// fsync() writes the page cache out as for any block device, then waits
+// for the backing file too; see osprd_sync.
+static int _osprd_fsync(struct file *filp, struct dentry *dentry,
+			int datasync)
+{
+	int r = (*blkdev_fsync)(filp, dentry, datasync);
+	if (r == 0 && file2osprd(filp))
+		r = osprd_sync(file2osprd(filp));
+	return r;
+}
+
+static ssize_t (*blkdev_read)(struct file *, char __user *, size_t, loff_t *);
+static ssize_t (*blkdev_write)(struct file *, const char __user *, size_t,
+			       loff_t *);
+static int (*blkdev_mmap)(struct file *, struct vm_area_struct *);
+
+// Direct-access devices bypass the page cache; see osprd_dax_rw.
+static ssize_t _osprd_read(struct file *filp, char __user *buf, size_t count,
+			   loff_t *ppos)
+{
+	osprd_info_t *d = file2osprd(filp);
+	if (d && d->dax)
+		return osprd_dax_rw(d, buf, count, ppos, 0);
+	return (*blkdev_read)(filp, buf, count, ppos);
+}
+
+static ssize_t _osprd_write(struct file *filp, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	osprd_info_t *d = file2osprd(filp);
+	if (d && d->dax)
+		return osprd_dax_rw(d, (char __user *) buf, count, ppos, 1);
+	return (*blkdev_write)(filp, buf, count, ppos);
+}
+
+static int _osprd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	osprd_info_t *d = file2osprd(filp);
+	if (d && d->dax)
+		return osprd_dax_mmap(d, vma);
+	return (*blkdev_mmap)(filp, vma);
+}
+
 static int _osprd_open(struct inode *inode, struct file *filp)
 {
 	if (!osprd_blk_fops.open) {
 		memcpy(&osprd_blk_fops, filp->f_op, sizeof(osprd_blk_fops));
 		blkdev_release = osprd_blk_fops.release;
 		osprd_blk_fops.release = _osprd_release;
+		osprd_blk_fops.poll = osprd_poll;
+		blkdev_fsync = osprd_blk_fops.fsync;
+		osprd_blk_fops.fsync = _osprd_fsync;
+		blkdev_read = osprd_blk_fops.read;
+		osprd_blk_fops.read = _osprd_read;
+		blkdev_write = osprd_blk_fops.write;
+		osprd_blk_fops.write = _osprd_write;
+		blkdev_mmap = osprd_blk_fops.mmap;
+		osprd_blk_fops.mmap = _osprd_mmap;
 	}
 	filp->f_op = &osprd_blk_fops;
 	return osprd_open(inode, filp);
@@ -472,32 +3309,95 @@ static void for_each_open_file(struct task_struct *task,
 
 static void cleanup_device(osprd_info_t *d)
 {
-	wake_up_all(&d->blockq);
+	osprd_cleanup_backing(d);
+	if (d->queue) {		// Complete any delayed requests.
+		// Work already queued may set the timer again.
+		hrtimer_cancel(&d->emu_timer);
+		kblockd_flush();
+		hrtimer_cancel(&d->emu_timer);
+		osprd_emu_complete(d, 1);
+	}
 	if (d->gd) {
 		del_gendisk(d->gd);
 		put_disk(d->gd);
 	}
 	if (d->queue)
 		blk_cleanup_queue(d->queue);
-	if (d->data)
-		vfree(d->data);
+	if (d->pcpu_readers)
+		free_percpu(d->pcpu_readers);
+	if (d->stats)
+		free_percpu(d->stats);
+	osprd_free_pages(d);
 }
 
 
 // Initialize a osprd_info_t.
 
+// A writer holds all of a device's page locks at once, so to lockdep each
+// must be a class of its own.
+static struct lock_class_key osprd_pages_lock_keys[OSPRD_PAGE_LOCKS];
+
 static int setup_device(osprd_info_t *d, int which)
 {
+	int r, i;
+
 	memset(d, 0, sizeof(osprd_info_t));
 
-	/* Get memory to store the actual block data. */
-	if (!(d->data = vmalloc(nsectors * SECTOR_SIZE)))
+	/* The block data is allocated a page at a time as it is written. */
+	INIT_RADIX_TREE(&d->pages, GFP_ATOMIC);
+	for (i = 0; i < OSPRD_PAGE_LOCKS; i++) {
+		rwlock_init(&d->pages_locks[i].lock);
+		lockdep_set_class(&d->pages_locks[i].lock,
+				  &osprd_pages_lock_keys[i]);
+	}
+	atomic_set(&d->nr_pages, 0);
+
+	/* Statistics, which must exist before the disk sees any I/O. */
+	if (!(d->stats = alloc_percpu(osprd_stats_t)))
+		return -1;
+
+	/* Per-CPU reader counts, if asked for, before anyone can open the
+	 * disk and take a lock. */
+	if (percpu[which] && !(d->pcpu_readers = alloc_percpu(int)))
 		return -1;
-	memset(d->data, 0, nsectors * SECTOR_SIZE);
+
+	/* Compressed mode, if asked for; osprd_init set up the compressors.
+	 * Direct access needs real pages, so it loses to compression.
+	 * Checksums are kept by osprd_transfer, which neither mode uses for
+	 * all of its data. */
+	d->compress = compress[which];
+	d->dax = dax[which] && !compress[which];
+	if (dax[which] && compress[which])
+		printk(KERN_WARNING "osprd: osprd%c is compressed, so no dax\n",
+		       which + 'a');
+	d->checksum = checksum[which] && !compress[which] && !dax[which];
+	if (checksum[which] && !d->checksum)
+		printk(KERN_WARNING "osprd: osprd%c is %s, so no checksums\n",
+		       which + 'a', compress[which] ? "compressed" : "dax");
+	INIT_RADIX_TREE(&d->crcs, GFP_ATOMIC);
+	atomic_long_set(&d->zbytes, 0);
+	atomic_set(&d->zsame, 0);
+
+	/* Call the setup function. */
+	osprd_setup(d);
+	d->nsectors = sizes[which] > 0 ? sizes[which] : nsectors;
+
+	/* The slower disk to emulate, if any. */
+	d->emu.latency_us = latency_us[which];
+	d->emu.jitter_us = jitter_us[which];
+	d->emu.jitter_exp = jitter_exp[which];
+	d->emu.bandwidth_kb = bandwidth_kb[which];
+	d->emu.depth = queue_depth[which];
+	d->emu_random = which + 1;
 
 	/* Set up the I/O queue. */
 	spin_lock_init(&d->qlock);
-	if (!(d->queue = blk_init_queue(osprd_process_request_queue, &d->qlock)))
+	if (make_request) {
+		if (!(d->queue = blk_alloc_queue(GFP_KERNEL)))
+			return -1;
+		blk_queue_make_request(d->queue, osprd_make_request);
+	} else if (!(d->queue = blk_init_queue(osprd_process_request_queue,
+					       &d->qlock)))
 		return -1;
 	blk_queue_hardsect_size(d->queue, SECTOR_SIZE);
 	d->queue->queuedata = d;
@@ -511,17 +3411,265 @@ static int setup_device(osprd_info_t *d, int which)
 	d->gd->queue = d->queue;
 	d->gd->private_data = d;
 	snprintf(d->gd->disk_name, 32, "osprd%c", which + 'a');
-	set_capacity(d->gd, nsectors);
+	set_capacity(d->gd, d->nsectors);
+
+	/* The backing file, loaded before anyone can see the disk. */
+	if (backing[which] && (r = osprd_setup_backing(d, backing[which])) < 0) {
+		printk(KERN_WARNING "osprd: can't use %s: %d\n",
+		       backing[which], r);
+		put_disk(d->gd);
+		d->gd = NULL;
+		return -1;
+	}
 	add_disk(d->gd);
 
-	/* Call the setup function. */
-	osprd_setup(d);
+	return 0;
+}
+
+/* osprd_stats_sum(d, sum) adds up d's per-CPU statistics into sum.  The
+counters are read without locking, so a sum taken during I/O is only
+approximately consistent.												*/
+static void osprd_stats_sum(osprd_info_t *d, osprd_stats_t *sum)
+{
+	int cpu, i, b;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		osprd_stats_t *s = per_cpu_ptr(d->stats, cpu);
+		for (i = 0; i < 2; i++) {
+			sum->ops[i] += s->ops[i];
+			sum->bytes[i] += s->bytes[i];
+			sum->locks[i] += s->locks[i];
+			sum->zns[i] += s->zns[i];
+			sum->zbytes[i] += s->zbytes[i];
+			for (b = 0; b < OSPRD_HIST; b++) {
+				sum->size[i][b] += s->size[i][b];
+				sum->latency[i][b] += s->latency[i][b];
+				sum->wait[i][b] += s->wait[i][b];
+				sum->hold[i][b] += s->hold[i][b];
+			}
+		}
+		sum->cancels += s->cancels;
+		sum->wakeups += s->wakeups;
+		sum->crc_errors += s->crc_errors;
+	}
+}
+
+/* osprd_snapshot_pages(d, shared, private) counts the pages of a snapshot
+that it still shares and those it alone holds, because the origin has
+written them since.														*/
+static void osprd_snapshot_pages(osprd_info_t *d, unsigned long *shared,
+				 unsigned long *private)
+{
+	struct page *batch[16];
+	unsigned long index = 0;
+	rwlock_t *pl;
+	int n, i;
+
+	*shared = *private = 0;
+	pl = osprd_read_lock_pages(d);
+	while ((n = radix_tree_gang_lookup(&d->pages, (void **) batch,
+					   index, 16)) > 0)
+		for (i = 0; i < n; i++) {
+			index = batch[i]->index + 1;
+			if (osprd_page_shared(d, batch[i]))
+				(*shared)++;
+			else
+				(*private)++;
+		}
+	read_unlock(pl);
+}
+
+/* osprd_ns_per_mb(ns, bytes) returns the time in ns per MB of 'bytes'.	*/
+static unsigned long long osprd_ns_per_mb(u64 ns, u64 bytes)
+{
+	u64 kb = bytes >> 10;
+
+	if (kb == 0)
+		return 0;
+	ns <<= 10;
+	do_div(ns, (u32) kb);
+	return ns;
+}
+
+/* osprd_proc_zip(m, d, s) prints how well a compressed device compresses:
+the memory it uses, including the osprd_zpage_ts, the ratio of the data it
+holds to that, and the CPU time its pages take.							*/
+static void osprd_proc_zip(struct seq_file *m, osprd_info_t *d,
+			   osprd_stats_t *s)
+{
+	unsigned long used = atomic_long_read(&d->zbytes);
+	u64 ratio = (u64) atomic_read(&d->nr_pages) * PAGE_SIZE * 100;
+
+	if (used)
+		do_div(ratio, used);
+	else
+		ratio = 0;
+	seq_printf(m, "  compressed into %lu KB (%d pages same-filled), "
+		   "ratio %llu.%02llu\n", used / 1024, atomic_read(&d->zsame),
+		   (unsigned long long) ratio / 100,
+		   (unsigned long long) ratio % 100);
+	seq_printf(m, "  compress %llu ns/MB, decompress %llu ns/MB\n",
+		   osprd_ns_per_mb(s->zns[1], s->zbytes[1]),
+		   osprd_ns_per_mb(s->zns[0], s->zbytes[0]));
+}
+
+/* osprd_proc_hist(m, name, hist) prints the nonempty buckets of a log2
+histogram as "<LIMIT:COUNT", where LIMIT is the bucket's upper bound.	*/
+static void osprd_proc_hist(struct seq_file *m, const char *name,
+			    unsigned long *hist)
+{
+	int b;
+
+	seq_printf(m, "  %s:", name);
+	for (b = 0; b < OSPRD_HIST; b++)
+		if (hist[b])
+			seq_printf(m, " <%llu:%lu", 1ULL << b, hist[b]);
+	seq_printf(m, "\n");
+}
+
+/* /proc/osprd shows, for each device, how much memory it holds (for a
+ * snapshot, how much of that it shares with other devices; for a compressed
+ * device, how much it really uses), the sectors that failed their checksums
+ * on a checksummed device, its I/O and its lock traffic.  Sizes are in
+ * bytes, latencies in ns, and lock waits and holds in us;
+ * OSPRDIOCRESETSTATS zeroes the counts. */
 
+static int osprd_proc_show(struct seq_file *m, void *v)
+{
+	int i, depth;
+	osprd_stats_t *s;
+	osprd_waiter_t *w;
+
+	// Too big for the kernel stack.
+	if (!(s = kmalloc(sizeof(*s), GFP_KERNEL)))
+		return -ENOMEM;
+
+	for (i = 0; i < ndevices; i++) {
+		osprd_info_t *d = &osprds[i];
+		unsigned long resident = atomic_read(&d->nr_pages);
+		seq_printf(m, "osprd%c: %lu of %lu pages resident (%lu KB)\n",
+			   'a' + i, resident, osprd_npages(d),
+			   resident * (PAGE_SIZE / 1024));
+		if (d->origin) {
+			unsigned long shared, private;
+			osprd_snapshot_pages(d, &shared, &private);
+			seq_printf(m, "  snapshot of osprd%c: %lu pages shared, "
+				   "%lu private\n", 'a' + (int) (d->origin - osprds),
+				   shared, private);
+		}
+
+		osprd_stats_sum(d, s);
+		if (d->compress)
+			osprd_proc_zip(m, d, s);
+		if (d->bfile)
+			seq_printf(m, "  backing %s: %d pages dirty\n",
+				   backing[i], atomic_read(&d->ndirty));
+		if (d->checksum)
+			seq_printf(m, "  checksums (%s): %lu sectors failed\n",
+				   osprd_crc_sse42 ? "sse4.2" : "table",
+				   s->crc_errors);
+		if (osprd_emu_on(&d->emu))
+			seq_printf(m, "  emulating latency %u us, %s jitter %u us, "
+				   "%u KB/s, depth %u: %u in flight\n",
+				   d->emu.latency_us,
+				   d->emu.jitter_exp ? "exponential" : "uniform",
+				   d->emu.jitter_us, d->emu.bandwidth_kb,
+				   d->emu.depth, d->emu_inflight);
+		seq_printf(m, "  reads %lu (%llu bytes), writes %lu (%llu bytes)\n",
+			   s->ops[0], s->bytes[0], s->ops[1], s->bytes[1]);
+		osprd_proc_hist(m, "read size", s->size[0]);
+		osprd_proc_hist(m, "write size", s->size[1]);
+		osprd_proc_hist(m, "read latency", s->latency[0]);
+		osprd_proc_hist(m, "write latency", s->latency[1]);
+
+		depth = 0;
+		osp_spin_lock(&d->mutex);
+		list_for_each_entry(w, &d->waiters, link)
+			depth++;
+		if (d->upgrader)
+			depth++;
+		osp_spin_unlock(&d->mutex);
+		seq_printf(m, "  read locks %lu, write locks %lu, queued %d, "
+			   "cancels %lu, wakeups %lu\n", s->locks[0], s->locks[1],
+			   depth, s->cancels, s->wakeups);
+		osprd_proc_hist(m, "reader wait", s->wait[0]);
+		osprd_proc_hist(m, "writer wait", s->wait[1]);
+		osprd_proc_hist(m, "reader hold", s->hold[0]);
+		osprd_proc_hist(m, "writer hold", s->hold[1]);
+	}
+	kfree(s);
 	return 0;
 }
 
+static int osprd_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, osprd_proc_show, NULL);
+}
+
+static struct file_operations osprd_proc_fops = {
+	.owner = THIS_MODULE,
+	.open = osprd_proc_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+
 static void osprd_exit(void);
 
+/* osprd_zinit() sets up the size class caches and a compressor per CPU for
+compressed mode. 2.6.18 has no LZO, so the compressor is the crypto API's
+deflate. Returns 0 or -ENOMEM; osprd_zexit() cleans up either way.		*/
+static int osprd_zinit(void)
+{
+	int c, cpu;
+
+	if (!(osprd_zcache[0] = kmem_cache_create("osprd_zpage",
+						  sizeof(osprd_zpage_t),
+						  0, 0, NULL, NULL)))
+		return -ENOMEM;
+	for (c = 1; c < OSPRD_ZCLASSES; c++) {
+		snprintf(osprd_zcache_name[c], sizeof(osprd_zcache_name[c]),
+			 "osprd_z%d", c * OSPRD_ZSTEP);
+		if (!(osprd_zcache[c] = kmem_cache_create(osprd_zcache_name[c],
+							  c * OSPRD_ZSTEP,
+							  0, 0, NULL, NULL)))
+			return -ENOMEM;
+	}
+
+	if (!(osprd_zstreams = alloc_percpu(osprd_zstream_t)))
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		osprd_zstream_t *z = per_cpu_ptr(osprd_zstreams, cpu);
+		if (!(z->tfm = crypto_alloc_tfm("deflate", 0))
+		    || !(z->page = kmalloc(2 * PAGE_SIZE, GFP_KERNEL)))
+			return -ENOMEM;
+		z->out = z->page + PAGE_SIZE;
+	}
+	return 0;
+}
+
+static void osprd_zexit(void)
+{
+	int c, cpu;
+
+	if (osprd_zstreams) {
+		for_each_possible_cpu(cpu) {
+			osprd_zstream_t *z = per_cpu_ptr(osprd_zstreams, cpu);
+			if (z->tfm)
+				crypto_free_tfm(z->tfm);
+			kfree(z->page);
+		}
+		free_percpu(osprd_zstreams);
+		osprd_zstreams = NULL;
+	}
+	for (c = 0; c < OSPRD_ZCLASSES; c++)
+		if (osprd_zcache[c]) {
+			kmem_cache_destroy(osprd_zcache[c]);
+			osprd_zcache[c] = NULL;
+		}
+}
+
 
 // The kernel calls this function when the module is loaded.
 // It initializes the 4 osprd block devices.
@@ -529,6 +3677,7 @@ static void osprd_exit(void);
 static int __init osprd_init(void)
 {
 	int i, r;
+	struct proc_dir_entry *proc;
 
 	// shut up the compiler
 	(void) for_each_open_file;
@@ -543,8 +3692,36 @@ static int __init osprd_init(void)
 		return -EBUSY;
 	}
 
+	if (ndevices < 1 || ndevices > NOSPRD) {
+		printk(KERN_WARNING "osprd: ndevices must be 1 to %d\n", NOSPRD);
+		unregister_blkdev(OSPRD_MAJOR, "osprd");
+		return -EINVAL;
+	}
+
+	/* The CRC32C tables, for checksummed devices. */
+	osprd_crc_init();
+
+	/* Delayed completions, for devices that emulate slower disks. */
+	if (!(osprd_delayed_cache = kmem_cache_create("osprd_delayed",
+						      sizeof(osprd_delayed_t),
+						      0, 0, NULL, NULL))) {
+		unregister_blkdev(OSPRD_MAJOR, "osprd");
+		return -ENOMEM;
+	}
+
+	/* The compressors, if any device is compressed. */
+	for (i = 0; i < ndevices; i++)
+		if (compress[i]) {
+			if (osprd_zinit() < 0) {
+				printk(KERN_WARNING "osprd: can't set up compression\n");
+				osprd_exit();
+				return -ENOMEM;
+			}
+			break;
+		}
+
 	/* Initialize the device structures. */
-	for (i = r = 0; i < NOSPRD; i++)
+	for (i = r = 0; i < ndevices; i++)
 		if (setup_device(&osprds[i], i) < 0)
 			r = -EINVAL;
 
@@ -552,8 +3729,11 @@ static int __init osprd_init(void)
 		printk(KERN_EMERG "osprd: can't set up device structures\n");
 		osprd_exit();
 		return -EBUSY;
-	} else
-		return 0;
+	}
+
+	if ((proc = create_proc_entry("osprd", 0444, NULL)))
+		proc->proc_fops = &osprd_proc_fops;
+	return 0;
 }
 
 
@@ -563,8 +3743,12 @@ static int __init osprd_init(void)
 static void osprd_exit(void)
 {
 	int i;
-	for (i = 0; i < NOSPRD; i++)
+	remove_proc_entry("osprd", NULL);
+	for (i = 0; i < ndevices; i++)
 		cleanup_device(&osprds[i]);
+	osprd_zexit();
+	if (osprd_delayed_cache)
+		kmem_cache_destroy(osprd_delayed_cache);
 	unregister_blkdev(OSPRD_MAJOR, "osprd");
 }
 
@@ -5,5 +5,53 @@
 #define OSPRDIOCACQUIRE		42
 #define OSPRDIOCTRYACQUIRE	43
 #define OSPRDIOCRELEASE		44
+#define OSPRDIOCDISCARD		45	// arg: struct osprd_range *
+#define OSPRDIOCACQUIRERANGE	46	// arg: struct osprd_range *
+#define OSPRDIOCTRYACQUIRERANGE	47	// arg: struct osprd_range *
+#define OSPRDIOCRELEASERANGE	48	// arg: struct osprd_range *
+#define OSPRDIOCACQUIRETIMEOUT	49	// arg: timeout in milliseconds
+#define OSPRDIOCQUEUEACQUIRE	50	// then poll() for the lock
+#define OSPRDIOCUPGRADE		51	// read lock -> write lock
+#define OSPRDIOCDOWNGRADE	52	// write lock -> read lock
+#define OSPRDIOCACQUIREMANY	53	// arg: struct osprd_lock_batch *
+#define OSPRDIOCRESETSTATS	54	// zero the counts in /proc/osprd; needs
+					// a writable file or CAP_SYS_ADMIN
+#define OSPRDIOCSNAPSHOT	55	// arg: origin's fd, or -1 for none
+#define OSPRDIOCSYNC		56	// wait for the backing file
+#define OSPRDIOCSETSYNC		57	// arg: 1 for O_SYNC, 0 for write-back
+#define OSPRDIOCFLUSH		58	// write back the page cache
+#define OSPRDIOCRESIZE		59	// arg: the new size in sectors
+#define OSPRDIOCSETEMU		60	// arg: struct osprd_emulation *
+
+// A range of sectors, for OSPRDIOCDISCARD and the range lock ioctls.
+struct osprd_range {
+	unsigned long long sector;	// first sector
+	unsigned long long nsectors;	// number of sectors
+};
+
+// One lock of an OSPRDIOCACQUIREMANY batch.
+struct osprd_lock_request {
+	int fd;				// an open OSP ramdisk
+	int write;			// write lock (1) or read lock (0)?
+};
+
+// A batch of locks on different devices, taken all together or not at all.
+struct osprd_lock_batch {
+	struct osprd_lock_request *locks;
+	unsigned nlocks;
+	int try;			// fail with EBUSY rather than block?
+};
+
+// How a device pretends to be a slower disk, for OSPRDIOCSETEMU.  Each
+// request completes 'latency_us' plus a random jitter after it would have
+// finished on a disk of 'bandwidth_kb' KB/s.  All zeros turns this off.
+struct osprd_emulation {
+	unsigned latency_us;		// fixed latency of every request
+	unsigned jitter_us;		// jitter in [0, jitter_us), or the
+					// jitter's mean if jitter_exp
+	int jitter_exp;			// exponential (1) or uniform (0) jitter?
+	unsigned bandwidth_kb;		// KB per second, or 0 for no limit
+	unsigned depth;			// requests in flight at most, or 0
+};
 
 #endif
@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -16,8 +17,15 @@ void usage(int status)
 Reads from or writes to an OSP ramdisk device.\n\
 Usage: ./osprdaccess -w [SIZE] [OPTIONS] [DEVICE...] < DATA\n\
    or: ./osprdaccess -w [SIZE] -z [DEVICE...]        (writes zeros)\n\
+   or: ./osprdaccess -D [SIZE] [OPTIONS] [DEVICE...] (discards data)\n\
    or: ./osprdaccess -r [SIZE] [OPTIONS] [DEVICE...] > DATA\n\
+   or: ./osprdaccess -S ORIGIN [DEVICE]              (takes a snapshot)\n\
    SIZE is the number of bytes to read/write.  Default is whole file.\n\
+   -D discards SIZE bytes at OFF, which then read as zeros, and frees the\n\
+   ramdisk memory that held them.  OFF and SIZE must be multiples of 512.\n\
+   -S makes DEVICE a read-only snapshot of the ramdisk ORIGIN as it is now.\n\
+   The snapshot shares ORIGIN's memory until ORIGIN overwrites it.  With\n\
+   ORIGIN \"none\", DEVICE becomes an empty writable ramdisk again.\n\
    Options are:\n\
    -o OFF\n\
        Seek forward into the file to offset OFF before reading/writing.\n\
@@ -27,6 +35,20 @@ Usage: ./osprdaccess -w [SIZE] [OPTIONS] [DEVICE...] < DATA\n\
    -L [DELAY]\n\
        Attempt to lock the ramdisk without blocking.  This is like -l, but if\n\
        -l would block, -L will return a \"resource busy\" error instead.\n\
+   -T TIMEOUT\n\
+       With -l, give up with a \"timed out\" error if the lock is not\n\
+       granted within TIMEOUT seconds.\n\
+   -P\n\
+       With -l, queue for the lock without blocking in the kernel, then wait\n\
+       for it with poll(), as an event loop would.\n\
+   -m\n\
+       With -l or -L, lock all the devices together once they are all open,\n\
+       with one OSPRDIOCACQUIREMANY: either every lock is taken or none is,\n\
+       and they are taken in a fixed order, so batches cannot deadlock.\n\
+   -R\n\
+       With -l or -L, lock only the sectors to be read or written, from OFF\n\
+       to OFF+SIZE, instead of the whole ramdisk.  Range locks on disjoint\n\
+       sectors do not wait for each other.\n\
    -d DELAY\n\
        Wait DELAY seconds before reading/writing (but after locking).\n\
    DEVICE is the device to read/write.  The default is /dev/osprda.\n\
@@ -125,32 +147,95 @@ void transfer_zero(int fd2, ssize_t size)
 	}
 }
 
+/* Lock the sectors holding bytes [offset, offset + size) of the ramdisk,
+ * or from offset to the end if size < 0. */
+void lock_range(int devfd, ssize_t offset, ssize_t size, int try)
+{
+	struct osprd_range range;
+	off_t end = lseek(devfd, 0, SEEK_END);
+
+	if (end == (off_t) -1) {
+		perror("lseek");
+		exit(1);
+	}
+	if (size >= 0 && offset + size < end)
+		end = offset + size;
+	range.sector = offset / 512;
+	range.nsectors = end > offset ? (end + 511) / 512 - range.sector : 1;
+	if (ioctl(devfd, try ? OSPRDIOCTRYACQUIRERANGE : OSPRDIOCACQUIRERANGE,
+		  &range) == -1) {
+		perror(try ? "ioctl OSPRDIOCTRYACQUIRERANGE"
+		       : "ioctl OSPRDIOCACQUIRERANGE");
+		exit(1);
+	}
+}
+
+/* Queue for the ramdisk lock, then wait until poll() says it is granted. */
+void lock_queued(int devfd)
+{
+	struct pollfd pfd;
+
+	if (ioctl(devfd, OSPRDIOCQUEUEACQUIRE, NULL) == -1) {
+		perror("ioctl OSPRDIOCQUEUEACQUIRE");
+		exit(1);
+	}
+	pfd.fd = devfd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, -1) == -1)
+		if (errno != EINTR) {
+			perror("poll");
+			exit(1);
+		}
+}
+
 int main(int argc, char *argv[])
 {
 	char *newarg;
 	int devfd, ofd;
-	int i, r, timeout = 0, zero = 0;
+	int i, r, timeout = 0, zero = 0, discard = 0, rangelock = 0;
 	int mode = O_RDONLY, dolock = 0, dotrylock = 0;
 	ssize_t size = -1;
 	ssize_t offset = 0;
 	double delay = 0;
 	double lock_delay = 0;
+	double lock_timeout = -1;
+	int dopoll = 0;
+	int dobatch = 0, batchtry = 0;
+	struct osprd_lock_request batch[16];
+	struct osprd_lock_batch lockset;
 	const char *devname = "/dev/osprda";
+	const char *snapshot = NULL;
+
+	lockset.nlocks = 0;
 
  flag:
 	// Detect a read/write option
 	if (argc >= 2 && strcmp(argv[1], "-r") == 0) {
 		mode = O_RDONLY;
+		discard = 0;
 		argv++, argc--;
 		if (argc >= 2 && parse_ssize(argv[1], &size))
 			argv++, argc--;
 		goto flag;
 	} else if (argc >= 2 && strcmp(argv[1], "-w") == 0) {
 		mode = O_WRONLY;
+		discard = 0;
+		argv++, argc--;
+		if (argc >= 2 && parse_ssize(argv[1], &size))
+			argv++, argc--;
+		goto flag;
+	} else if (argc >= 2 && strcmp(argv[1], "-D") == 0) {
+		mode = O_WRONLY;
+		discard = 1;
 		argv++, argc--;
 		if (argc >= 2 && parse_ssize(argv[1], &size))
 			argv++, argc--;
 		goto flag;
+	} else if (argc >= 3 && strcmp(argv[1], "-S") == 0) {
+		mode = O_WRONLY;
+		snapshot = argv[2];
+		argv += 2, argc -= 2;
+		goto flag;
 	}
 
 	// Detect an offset
@@ -181,6 +266,35 @@ int main(int argc, char *argv[])
 		goto flag;
 	}
 
+	// Detect a lock timeout option
+	if (argc >= 2 && strcmp(argv[1], "-T") == 0) {
+		if (argc < 3 || !parse_double(argv[2], &lock_timeout))
+			usage(1);
+		argv += 2, argc -= 2;
+		goto flag;
+	}
+
+	// Detect a poll option
+	if (argc >= 2 && strcmp(argv[1], "-P") == 0) {
+		dopoll = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a batch lock option
+	if (argc >= 2 && strcmp(argv[1], "-m") == 0) {
+		dobatch = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
+	// Detect a range lock option
+	if (argc >= 2 && strcmp(argv[1], "-R") == 0) {
+		rangelock = 1;
+		argv++, argc--;
+		goto flag;
+	}
+
 	// Detect a delay option
 	if (argc >= 2 && strcmp(argv[1], "-d") == 0) {
 		argv++, argc--;
@@ -217,7 +331,23 @@ int main(int argc, char *argv[])
 	if (dolock || dotrylock) {
 		if (lock_delay >= 0)
 			sleep_for(lock_delay);
-		if (dolock
+		if (dobatch && lockset.nlocks < 16) {
+			batch[lockset.nlocks].fd = devfd;
+			batch[lockset.nlocks].write = (mode & O_WRONLY) != 0;
+			lockset.nlocks++;
+			batchtry = dotrylock;
+		} else if (dobatch)
+			usage(1);
+		else if (rangelock)
+			lock_range(devfd, offset, size, dotrylock);
+		else if (dolock && dopoll)
+			lock_queued(devfd);
+		else if (dolock && lock_timeout >= 0
+			 && ioctl(devfd, OSPRDIOCACQUIRETIMEOUT,
+				  (unsigned long) (lock_timeout * 1000)) == -1) {
+			perror("ioctl OSPRDIOCACQUIRETIMEOUT");
+			exit(1);
+		} else if (dolock && lock_timeout < 0
 		    && ioctl(devfd, OSPRDIOCACQUIRE, NULL) == -1) {
 			perror("ioctl OSPRDIOCACQUIRE");
 			exit(1);
@@ -236,6 +366,52 @@ int main(int argc, char *argv[])
 	if (argc > 1)
 		goto flag;
 
+	// Take the batched locks
+	if (lockset.nlocks) {
+		lockset.locks = batch;
+		lockset.try = batchtry;
+		if (ioctl(devfd, OSPRDIOCACQUIREMANY, &lockset) == -1) {
+			perror("ioctl OSPRDIOCACQUIREMANY");
+			exit(1);
+		}
+	}
+
+	// Snapshot
+	if (snapshot) {
+		int originfd = -1;
+		if (strcmp(snapshot, "none") != 0
+		    && (originfd = open(snapshot, O_RDONLY)) == -1) {
+			perror("open");
+			exit(1);
+		}
+		if (ioctl(devfd, OSPRDIOCSNAPSHOT, originfd) == -1) {
+			perror("ioctl OSPRDIOCSNAPSHOT");
+			exit(1);
+		}
+		exit(0);
+	}
+
+	// Discard
+	if (discard) {
+		struct osprd_range range;
+		off_t end = lseek(devfd, 0, SEEK_END);
+		if (end == (off_t) -1) {
+			perror("lseek");
+			exit(1);
+		}
+		if (size < 0 || offset + size > end)
+			size = offset < end ? end - offset : 0;
+		if (offset % 512 || size % 512)
+			usage(1);
+		range.sector = offset / 512;
+		range.nsectors = size / 512;
+		if (ioctl(devfd, OSPRDIOCDISCARD, &range) == -1) {
+			perror("ioctl OSPRDIOCDISCARD");
+			exit(1);
+		}
+		exit(0);
+	}
+
 	// Seek to offset
 	if (lseek(devfd, offset, SEEK_SET) == (off_t) -1) {
 		perror("lseek");
@@ -0,0 +1,1171 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "osprd.h"
+
+/* osprdbench runs benchmarks of the OSP ramdisk.  Some drive the real
+ * device; others are userspace models of the module's algorithms, so they
+ * can be run without booting the QEMU image.  Each model mirrors the
+ * kernel function named in its comment. */
+
+void usage(int status)
+{
+	fprintf(stderr, "\
+Benchmarks the OSP ramdisk.\n\
+Usage: ./osprdbench BENCHMARK [OPTIONS]\n\
+   Benchmarks are:\n\
+   sim [-m lock|stripe] [-r READERS] [-w WRITERS] [-t SECONDS]\n\
+       Model of the request path (osprd_transfer) on a 1 MB ramdisk:\n\
+       READERS and WRITERS threads copy random 1-8 sector requests.\n\
+       -m lock serializes every copy on one spinlock, as osprd used to;\n\
+       -m stripe (default) uses striped seqlocks.\n\
+   seq [-w] [-b BLOCK] [-t SECONDS] [-c] [DEVICE]\n\
+       Sequential throughput: read (or with -w, write) DEVICE from start\n\
+       to end in BLOCK-byte requests (default 65536), over and over for\n\
+       SECONDS (default 2).  I/O is O_DIRECT unless -c is given.  Compare\n\
+       a module loaded with make_request=0 against make_request=1.\n\
+   small [-n] [-b BLOCK] [-f EVERY] [-t SECONDS] [DEVICE]\n\
+       Small-write IOPS: random BLOCK-byte (default 512) writes to DEVICE\n\
+       through the page cache for SECONDS.  The file is O_SYNC, as\n\
+       osprd_open makes it, unless -n switches it to write-back with\n\
+       OSPRDIOCSETSYNC.  -f issues OSPRDIOCFLUSH every EVERY writes; a\n\
+       final flush is always timed, so write-back is not counted as free.\n\
+   crc [-m off|table|sse4.2] [-s MB] [-t SECONDS] [DEVICE]\n\
+       Model of a checksummed device (osprd_transfer with checksum=1):\n\
+       random 4 KB pages are written and read back, each sector's CRC32C\n\
+       computed on write and checked on read.  Without DEVICE the pages\n\
+       are copied to and from an MB-megabyte (default 256) buffer, larger\n\
+       than the caches, as the module copies them to and from its own.\n\
+       With DEVICE, say /dev/osprda loaded without checksums, they are\n\
+       written and read with O_DIRECT, so checksums are weighed against\n\
+       the whole I/O path.  Reports MB/s with checksums off and with each\n\
+       way of computing them, or, with -m, off and that one.\n\
+   rwlock [-m queue|ticket] [-r READERS] [-w WRITERS] [-h HOLD] [-t SECONDS]\n\
+       Model of the device lock (osprd_acquire): threads take and release\n\
+       read or write locks, holding each for HOLD microseconds (default 0).\n\
+       -m queue (default) uses the FIFO waiter queue; -m ticket uses the\n\
+       ticket lock it replaced, which woke every waiter on each change.\n\
+       Reports wakeups per wait and release-to-run handoff latency.\n\
+   brlock [-m percpu|mutex] [-r READERS] [-w WRITERS] [-i INTERVAL] [-t SECONDS]\n\
+       Model of per-CPU reader mode (osprd_lock): READERS threads take and\n\
+       release read locks as fast as they can, while WRITERS threads take a\n\
+       write lock every INTERVAL microseconds (default 1000).  -m percpu\n\
+       (default) counts readers per CPU; -m mutex counts them under the\n\
+       device mutex.  Run with -r 1, 2, 4... to see how readers scale.\n\
+   mq [-j THREADS] [-w PERCENT] [-b BLOCK] [-t SECONDS] [DEVICE]\n\
+       Submission scaling: 1, 2, 4... up to THREADS (default the number\n\
+       of CPUs) threads issue random O_DIRECT BLOCK-byte (default 4096)\n\
+       I/Os to DEVICE, PERCENT (default 0) of them writes, for SECONDS\n\
+       each.  Reports IOPS and the speedup over one thread.  Compare a\n\
+       module loaded with make_request=0, where every request takes the\n\
+       request queue's lock, against make_request=1.\n\
+   DEVICE defaults to /dev/osprda.\n");
+	exit(status);
+}
+
+int parse_int(const char *arg, int *result)
+{
+	char *end_arg;
+	long val = strtol(arg, &end_arg, 0);
+	if (*arg && !*end_arg && val >= 0) {
+		*result = val;
+		return 1;
+	} else
+		return 0;
+}
+
+double now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* A small xorshift generator, one per thread, so threads do not contend
+ * on rand()'s state. */
+unsigned next_random(unsigned *state)
+{
+	unsigned x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+
+/*****************************************************************************/
+/* sim: the request path                                                     */
+/*****************************************************************************/
+
+#define SECTOR_SIZE		512
+#define SIM_SECTORS		2048
+#define OSPRD_STRIPE_SECTORS	8
+#define OSPRD_NSTRIPES		64
+
+/* A userspace seqlock: the kernel's seqlock_t. */
+typedef struct sim_seqlock {
+	unsigned seq;
+	pthread_spinlock_t lock;
+} sim_seqlock_t;
+
+typedef struct sim_disk {
+	unsigned char data[SIM_SECTORS * SECTOR_SIZE];
+	int striped;
+	pthread_spinlock_t mutex;
+	sim_seqlock_t stripe[OSPRD_NSTRIPES];
+	volatile int stop;
+} sim_disk_t;
+
+typedef struct sim_thread {
+	pthread_t thread;
+	sim_disk_t *d;
+	int write;
+	unsigned seed;
+	unsigned long long bytes;
+	unsigned long long retries;
+} sim_thread_t;
+
+void sim_transfer(sim_thread_t *t, unsigned long sector, unsigned long nsect,
+		  unsigned char *buffer)
+{
+	sim_disk_t *d = t->d;
+
+	if (!d->striped) {
+		pthread_spin_lock(&d->mutex);
+		if (t->write)
+			memcpy(d->data + sector * SECTOR_SIZE, buffer,
+			       nsect * SECTOR_SIZE);
+		else
+			memcpy(buffer, d->data + sector * SECTOR_SIZE,
+			       nsect * SECTOR_SIZE);
+		pthread_spin_unlock(&d->mutex);
+		return;
+	}
+
+	// Mirrors osprd_transfer().
+	while (nsect > 0) {
+		unsigned long n = OSPRD_STRIPE_SECTORS
+			- sector % OSPRD_STRIPE_SECTORS;
+		sim_seqlock_t *s = &d->stripe[(sector / OSPRD_STRIPE_SECTORS)
+					      % OSPRD_NSTRIPES];
+		unsigned char *data = d->data + sector * SECTOR_SIZE;
+		unsigned seq;
+
+		if (n > nsect)
+			n = nsect;
+		if (t->write) {
+			pthread_spin_lock(&s->lock);
+			__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			memcpy(data, buffer, n * SECTOR_SIZE);
+			__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+			pthread_spin_unlock(&s->lock);
+		} else {
+			for (;;) {
+				while ((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1)
+					;
+				memcpy(buffer, data, n * SECTOR_SIZE);
+				__atomic_thread_fence(__ATOMIC_ACQUIRE);
+				if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+					break;
+				t->retries++;
+			}
+		}
+		sector += n;
+		nsect -= n;
+		buffer += n * SECTOR_SIZE;
+	}
+}
+
+void *sim_worker(void *arg)
+{
+	sim_thread_t *t = (sim_thread_t *) arg;
+	unsigned char buffer[OSPRD_STRIPE_SECTORS * SECTOR_SIZE];
+
+	memset(buffer, t->write, sizeof(buffer));
+	while (!t->d->stop) {
+		unsigned nsect = 1 + next_random(&t->seed) % OSPRD_STRIPE_SECTORS;
+		unsigned long sector = next_random(&t->seed)
+			% (SIM_SECTORS - nsect + 1);
+		sim_transfer(t, sector, nsect, buffer);
+		t->bytes += nsect * SECTOR_SIZE;
+	}
+	return NULL;
+}
+
+int bench_sim(int argc, char *argv[])
+{
+	static sim_disk_t d;
+	int readers = 4, writers = 0, seconds = 2;
+	int i, n, opt;
+	sim_thread_t *threads;
+	unsigned long long rbytes = 0, wbytes = 0, retries = 0;
+	double start, elapsed;
+
+	d.striped = 1;
+	while ((opt = getopt(argc, argv, "m:r:w:t:")) != -1)
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "lock") == 0)
+				d.striped = 0;
+			else if (strcmp(optarg, "stripe") != 0)
+				usage(1);
+			break;
+		case 'r': if (!parse_int(optarg, &readers)) usage(1); break;
+		case 'w': if (!parse_int(optarg, &writers)) usage(1); break;
+		case 't': if (!parse_int(optarg, &seconds)) usage(1); break;
+		default: usage(1);
+		}
+
+	pthread_spin_init(&d.mutex, PTHREAD_PROCESS_PRIVATE);
+	for (i = 0; i < OSPRD_NSTRIPES; i++)
+		pthread_spin_init(&d.stripe[i].lock, PTHREAD_PROCESS_PRIVATE);
+
+	n = readers + writers;
+	threads = calloc(n, sizeof(*threads));
+	start = now();
+	for (i = 0; i < n; i++) {
+		threads[i].d = &d;
+		threads[i].write = i >= readers;
+		threads[i].seed = 2463534242u + i;
+		pthread_create(&threads[i].thread, NULL, sim_worker, &threads[i]);
+	}
+	sleep(seconds);
+	d.stop = 1;
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].write)
+			wbytes += threads[i].bytes;
+		else
+			rbytes += threads[i].bytes;
+		retries += threads[i].retries;
+	}
+	elapsed = now() - start;
+
+	printf("%s: %d readers, %d writers, %.2f s\n",
+	       d.striped ? "stripe" : "lock", readers, writers, elapsed);
+	printf("read  %10.1f MB/s\n", rbytes / elapsed / 1e6);
+	printf("write %10.1f MB/s\n", wbytes / elapsed / 1e6);
+	if (d.striped)
+		printf("read retries %llu\n", retries);
+	free(threads);
+	return 0;
+}
+
+
+/*****************************************************************************/
+/* seq: sequential throughput of the device                                  */
+/*****************************************************************************/
+
+/* Open DEVICE for the device benchmarks, O_DIRECT unless cached, and
+ * return its size in *size. */
+int open_device(const char *devname, int mode, int cached, off_t *size)
+{
+	int fd = open(devname, mode | (cached ? 0 : O_DIRECT));
+	if (fd == -1) {
+		perror("open");
+		exit(1);
+	}
+	if ((*size = lseek(fd, 0, SEEK_END)) == (off_t) -1
+	    || lseek(fd, 0, SEEK_SET) == (off_t) -1) {
+		perror("lseek");
+		exit(1);
+	}
+	return fd;
+}
+
+int bench_seq(int argc, char *argv[])
+{
+	const char *devname = "/dev/osprda";
+	int write_mode = 0, cached = 0, block = 65536, seconds = 2, opt;
+	unsigned long long bytes = 0;
+	off_t size, pos;
+	double start, elapsed;
+	void *buf;
+	int fd;
+
+	while ((opt = getopt(argc, argv, "wb:t:c")) != -1)
+		switch (opt) {
+		case 'w': write_mode = 1; break;
+		case 'b': if (!parse_int(optarg, &block) || block % 512) usage(1); break;
+		case 't': if (!parse_int(optarg, &seconds)) usage(1); break;
+		case 'c': cached = 1; break;
+		default: usage(1);
+		}
+	if (optind < argc)
+		devname = argv[optind];
+
+	fd = open_device(devname, write_mode ? O_WRONLY : O_RDONLY, cached, &size);
+	if (block > size)
+		block = size;	// the default device is only 16 KB
+	if (posix_memalign(&buf, 4096, block) != 0) {
+		perror("posix_memalign");
+		exit(1);
+	}
+	memset(buf, 0x5a, block);
+
+	start = now();
+	do {
+		for (pos = 0; pos + block <= size; pos += block) {
+			ssize_t r = write_mode ? pwrite(fd, buf, block, pos)
+				: pread(fd, buf, block, pos);
+			if (r != block) {
+				perror(write_mode ? "write" : "read");
+				exit(1);
+			}
+			bytes += block;
+		}
+	} while ((elapsed = now() - start) < seconds);
+
+	printf("%s %s, %d-byte blocks: %.1f MB/s (%llu bytes in %.2f s)\n",
+	       write_mode ? "write" : "read", devname, block,
+	       bytes / elapsed / 1e6, bytes, elapsed);
+	close(fd);
+	free(buf);
+	return 0;
+}
+
+
+/*****************************************************************************/
+/* small: small-write IOPS, O_SYNC against write-back                        */
+/*****************************************************************************/
+
+int bench_small(int argc, char *argv[])
+{
+	const char *devname = "/dev/osprda";
+	int nosync = 0, block = 512, every = 0, seconds = 2, opt;
+	unsigned long long writes = 0;
+	unsigned seed = 1;
+	off_t size;
+	double start, elapsed;
+	char *buf;
+	int fd;
+
+	while ((opt = getopt(argc, argv, "nb:f:t:")) != -1)
+		switch (opt) {
+		case 'n': nosync = 1; break;
+		case 'b': if (!parse_int(optarg, &block) || block % 512 || !block) usage(1); break;
+		case 'f': if (!parse_int(optarg, &every)) usage(1); break;
+		case 't': if (!parse_int(optarg, &seconds)) usage(1); break;
+		default: usage(1);
+		}
+	if (optind < argc)
+		devname = argv[optind];
+
+	fd = open_device(devname, O_WRONLY, 1, &size);
+	if (block > size)
+		block = size;
+	if (nosync && ioctl(fd, OSPRDIOCSETSYNC, 0) == -1) {
+		perror("ioctl OSPRDIOCSETSYNC");
+		exit(1);
+	}
+	if (!(buf = malloc(block))) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(buf, 0x5a, block);
+
+	start = now();
+	do {
+		off_t pos = (off_t) (next_random(&seed) % (size / block)) * block;
+		if (pwrite(fd, buf, block, pos) != block) {
+			perror("write");
+			exit(1);
+		}
+		writes++;
+		if (every && writes % every == 0
+		    && ioctl(fd, OSPRDIOCFLUSH, 0) == -1) {
+			perror("ioctl OSPRDIOCFLUSH");
+			exit(1);
+		}
+	} while (now() - start < seconds);
+	if (ioctl(fd, OSPRDIOCFLUSH, 0) == -1) {
+		perror("ioctl OSPRDIOCFLUSH");
+		exit(1);
+	}
+	elapsed = now() - start;
+
+	printf("%s %s, %d-byte random writes: %.0f IOPS (%llu writes in %.2f s)\n",
+	       nosync ? "write-back" : "O_SYNC", devname, block,
+	       writes / elapsed, writes, elapsed);
+	close(fd);
+	free(buf);
+	return 0;
+}
+
+
+/*****************************************************************************/
+/* crc: the cost of per-sector checksums                                     */
+/*****************************************************************************/
+
+#define CRC_SECTORS	8		// per 4 KB page
+
+enum { CRC_OFF, CRC_TABLE, CRC_SSE42 };
+static const char *crc_modes[] = { "off", "table", "sse4.2" };
+
+static unsigned crc_table[8][256];
+
+// Mirrors osprd_crc_init().
+void crc_init(void)
+{
+	unsigned c;
+	int b, k;
+
+	for (b = 0; b < 256; b++) {
+		for (c = b, k = 0; k < 8; k++)
+			c = (c >> 1) ^ (c & 1 ? 0x82f63b78 : 0);
+		crc_table[0][b] = c;
+	}
+	for (b = 0; b < 256; b++)
+		for (k = 1; k < 8; k++) {
+			c = crc_table[k - 1][b];
+			crc_table[k][b] = (c >> 8) ^ crc_table[0][c & 0xff];
+		}
+}
+
+int crc_have_sse42(void)
+{
+#if defined(__x86_64__)
+	return __builtin_cpu_supports("sse4.2");
+#else
+	return 0;
+#endif
+}
+
+// Mirrors osprd_crc32c(): the CRC32C of each of n 512-byte sectors, three
+// sectors at once with SSE4.2.
+void crc_sectors(const unsigned char *p, int n, unsigned *crcs, int mode)
+{
+	unsigned (*t)[256] = crc_table;
+	unsigned crc;
+	int i;
+
+#if defined(__x86_64__)
+	if (mode == CRC_SSE42) {
+		for (; n > 0; n -= n < 3 ? n : 3, p += 3 * 512, crcs += 3) {
+			unsigned long a = ~0U, b = ~0U, c = ~0U;
+			const unsigned char *p1 = n > 1 ? p + 512 : p;
+			const unsigned char *p2 = n > 2 ? p + 2 * 512 : p1;
+			for (i = 0; i < 512; i += 8) {
+				// crc32q %rcx, %rax; %rcx, %rdx; %rcx, %rbx
+				asm(".byte 0xf2, 0x48, 0x0f, 0x38, 0xf1, 0xc1"
+				    : "=a" (a)
+				    : "0" (a), "c" (*(unsigned long *) (p + i)));
+				asm(".byte 0xf2, 0x48, 0x0f, 0x38, 0xf1, 0xd1"
+				    : "=d" (b)
+				    : "0" (b), "c" (*(unsigned long *) (p1 + i)));
+				asm(".byte 0xf2, 0x48, 0x0f, 0x38, 0xf1, 0xd9"
+				    : "=b" (c)
+				    : "0" (c), "c" (*(unsigned long *) (p2 + i)));
+			}
+			crcs[0] = ~a;
+			if (n > 1)
+				crcs[1] = ~b;
+			if (n > 2)
+				crcs[2] = ~c;
+		}
+		return;
+	}
+#endif
+	for (; n > 0; n--, crcs++) {
+		crc = ~0;
+		for (i = 0; i < 512; i += 8, p += 8) {
+			crc ^= p[0] | p[1] << 8 | p[2] << 16 | (unsigned) p[3] << 24;
+			crc = t[7][crc & 0xff] ^ t[6][(crc >> 8) & 0xff]
+				^ t[5][(crc >> 16) & 0xff] ^ t[4][crc >> 24]
+				^ t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+		}
+		*crcs = ~crc;
+	}
+}
+
+/* Model of osprd_transfer on a checksummed device: random 4 KB pages are
+ * written (checksum, then copy) and read back (copy, then check), as a
+ * write and a read with make_request=1 would be.  The pages are copied to
+ * and from 'disk', or, if fd is a device, written and read with pwrite and
+ * pread.  Returns MB/s. */
+double crc_run(int mode, int seconds, int fd, size_t size,
+	       unsigned long long *errors)
+{
+	size_t npages = size / 4096, page, i;
+	unsigned char *disk = NULL, *written, *buf;
+	unsigned *crcs, c[CRC_SECTORS], zero;
+	unsigned long long bytes = 0;
+	unsigned seed = 1;
+	double start, elapsed;
+	void *mem;
+	int s;
+
+	if (fd < 0 && !(disk = calloc(npages, 4096))) {
+		perror("calloc");
+		exit(1);
+	}
+	if (posix_memalign(&mem, 4096, 4096) != 0
+	    || !(crcs = malloc(npages * CRC_SECTORS * sizeof(unsigned)))
+	    || !(written = calloc(npages, 1))) {
+		perror("malloc");
+		exit(1);
+	}
+	buf = mem;
+	// The model's pages start out zero; a device's are checked only once
+	// this run has written them.
+	memset(buf, 0, 4096);
+	crc_sectors(buf, 1, &zero, CRC_TABLE);
+	for (i = 0; i < npages * CRC_SECTORS; i++)
+		crcs[i] = zero;
+	for (i = 0; i < 4096; i++)
+		buf[i] = next_random(&seed);
+	if (fd < 0)
+		memset(written, 1, npages);
+
+	start = now();
+	do {
+		for (i = 0; i < 1024; i++) {
+			page = next_random(&seed) % npages;
+			buf[i] ^= 1;	// new data for every write
+			if (mode != CRC_OFF)
+				crc_sectors(buf, CRC_SECTORS, c, mode);
+			if (fd < 0)
+				memcpy(disk + page * 4096, buf, 4096);
+			else if (pwrite(fd, buf, 4096, page * 4096) != 4096) {
+				perror("write");
+				exit(1);
+			}
+			if (mode != CRC_OFF)
+				memcpy(crcs + page * CRC_SECTORS, c, sizeof(c));
+			written[page] = 1;
+
+			page = next_random(&seed) % npages;
+			if (fd < 0)
+				memcpy(buf, disk + page * 4096, 4096);
+			else if (pread(fd, buf, 4096, page * 4096) != 4096) {
+				perror("read");
+				exit(1);
+			}
+			if (mode != CRC_OFF && written[page]) {
+				crc_sectors(buf, CRC_SECTORS, c, mode);
+				for (s = 0; s < CRC_SECTORS; s++)
+					if (c[s] != crcs[page * CRC_SECTORS + s])
+						(*errors)++;
+			}
+		}
+		bytes += 1024 * 2 * 4096;
+	} while ((elapsed = now() - start) < seconds);
+
+	free(disk);
+	free(written);
+	free(crcs);
+	free(buf);
+	return bytes / elapsed / 1e6;
+}
+
+int bench_crc(int argc, char *argv[])
+{
+	int mode = -1, seconds = 2, mb = 256, opt, m, fd = -1;
+	unsigned long long errors = 0;
+	unsigned char sectors[3 * 512];
+	unsigned table[3], sse42[3];
+	double off = 0, mbs;
+	off_t size;
+
+	while ((opt = getopt(argc, argv, "m:s:t:")) != -1)
+		switch (opt) {
+		case 'm':
+			for (mode = 0; mode < 3; mode++)
+				if (strcmp(optarg, crc_modes[mode]) == 0
+				    || (mode == CRC_SSE42
+					&& strcmp(optarg, "sse42") == 0))
+					break;
+			if (mode == 3)
+				usage(1);
+			break;
+		case 's': if (!parse_int(optarg, &mb) || !mb) usage(1); break;
+		case 't': if (!parse_int(optarg, &seconds)) usage(1); break;
+		default: usage(1);
+		}
+	if (optind < argc) {
+		fd = open_device(argv[optind], O_RDWR, 0, &size);
+		if (size < 4096) {
+			fprintf(stderr, "%s is smaller than a page\n",
+				argv[optind]);
+			exit(1);
+		}
+		printf("%s, %llu MB\n", argv[optind],
+		       (unsigned long long) size >> 20);
+	} else {
+		size = (off_t) mb << 20;
+		printf("%d MB model\n", mb);
+	}
+
+	crc_init();
+	if (mode == CRC_SSE42 && !crc_have_sse42()) {
+		fprintf(stderr, "This CPU has no SSE4.2.\n");
+		exit(1);
+	}
+	// The two ways must agree, or the kernel's would not either.
+	for (m = 0; m < (int) sizeof(sectors); m++)
+		sectors[m] = m * 7 + 3;
+	for (m = 1; m <= 3 && crc_have_sse42(); m++) {
+		crc_sectors(sectors, m, table, CRC_TABLE);
+		crc_sectors(sectors, m, sse42, CRC_SSE42);
+		if (memcmp(table, sse42, m * sizeof(unsigned)) != 0) {
+			fprintf(stderr, "table and sse4.2 CRCs differ\n");
+			exit(1);
+		}
+	}
+
+	for (m = 0; m < 3; m++) {
+		if ((mode >= 0 && m != mode && m != CRC_OFF)
+		    || (m == CRC_SSE42 && !crc_have_sse42()))
+			continue;
+		mbs = crc_run(m, seconds, fd, size, &errors);
+		if (m == CRC_OFF)
+			off = mbs;
+		if (m == CRC_OFF || mode == CRC_OFF)
+			printf("checksums %-6s %8.0f MB/s\n", crc_modes[m], mbs);
+		else
+			printf("checksums %-6s %8.0f MB/s (%.0f%% of off)\n",
+			       crc_modes[m], mbs, 100 * mbs / off);
+		if (mode == CRC_OFF)
+			break;
+	}
+	if (fd >= 0)
+		close(fd);
+	if (errors) {
+		fprintf(stderr, "%llu sectors failed their checksums\n", errors);
+		exit(1);
+	}
+	return 0;
+}
+
+
+/*****************************************************************************/
+/* rwlock: contention on the device lock                                     */
+/*****************************************************************************/
+
+/* A waiter in the queued lock: osprd_waiter_t. */
+typedef struct rw_waiter {
+	struct rw_waiter *next;
+	int write;
+	int granted;
+	pthread_cond_t wake;
+} rw_waiter_t;
+
+typedef struct rw_lock {
+	pthread_mutex_t mutex;		// the device 'mutex'
+	int queued;			// queue (1) or ticket (0) model?
+	int num_readers, num_writers;
+	rw_waiter_t *head, **tail;	// queue model: the 'waiters' queue
+	unsigned ticket_head, ticket_tail;	// ticket model
+	pthread_cond_t blockq;		// ticket model: the old 'blockq'
+	double released;		// time of the last release
+	volatile int stop;
+} rw_lock_t;
+
+typedef struct rw_thread {
+	pthread_t thread;
+	rw_lock_t *l;
+	int write;
+	int hold_us;
+	unsigned long long acquires;	// lock acquisitions
+	unsigned long long waits;	// ...that had to sleep
+	unsigned long long wakeups;	// times woken
+	unsigned long long useless;	// ...only to sleep again
+	double handoff;			// total release-to-run time
+} rw_thread_t;
+
+int rw_free(rw_lock_t *l, int write)
+{
+	return l->num_writers == 0 && (!write || l->num_readers == 0);
+}
+
+void rw_hold(rw_lock_t *l, int write)
+{
+	if (write)
+		l->num_writers++;
+	else
+		l->num_readers++;
+}
+
+// Mirrors osprd_grant().
+void rw_grant(rw_lock_t *l)
+{
+	rw_waiter_t *w;
+	while ((w = l->head) && rw_free(l, w->write)) {
+		if (!(l->head = w->next))
+			l->tail = &l->head;
+		rw_hold(l, w->write);
+		w->granted = 1;
+		pthread_cond_signal(&w->wake);
+	}
+}
+
+// Mirrors osprd_acquire(); with -m ticket, the ticket lock it replaced,
+// where every change woke every waiter.
+void rw_acquire(rw_thread_t *t)
+{
+	rw_lock_t *l = t->l;
+	int slept = 0;
+
+	pthread_mutex_lock(&l->mutex);
+	if (l->queued) {
+		rw_waiter_t w;
+		if (!l->head && rw_free(l, t->write))
+			rw_hold(l, t->write);
+		else {
+			w.next = NULL;
+			w.write = t->write;
+			w.granted = 0;
+			pthread_cond_init(&w.wake, NULL);
+			*l->tail = &w;
+			l->tail = &w.next;
+			for (slept = 1; !w.granted; t->wakeups++)
+				pthread_cond_wait(&w.wake, &l->mutex);
+			pthread_cond_destroy(&w.wake);
+		}
+	} else {
+		unsigned ticket = l->ticket_head++;
+		while (!(rw_free(l, t->write) && l->ticket_tail == ticket)) {
+			if (slept)
+				t->useless++;
+			slept = 1;
+			pthread_cond_wait(&l->blockq, &l->mutex);
+			t->wakeups++;
+		}
+		rw_hold(l, t->write);
+		l->ticket_tail++;
+		pthread_cond_broadcast(&l->blockq);
+	}
+	t->acquires++;
+	if (slept) {
+		t->waits++;
+		t->handoff += now() - l->released;
+	}
+	pthread_mutex_unlock(&l->mutex);
+}
+
+// Mirrors osprd_release().
+void rw_release(rw_thread_t *t)
+{
+	rw_lock_t *l = t->l;
+
+	pthread_mutex_lock(&l->mutex);
+	if (t->write)
+		l->num_writers--;
+	else
+		l->num_readers--;
+	l->released = now();
+	if (l->queued)
+		rw_grant(l);
+	else
+		pthread_cond_broadcast(&l->blockq);
+	pthread_mutex_unlock(&l->mutex);
+}
+
+void *rw_worker(void *arg)
+{
+	rw_thread_t *t = (rw_thread_t *) arg;
+
+	while (!t->l->stop) {
+		rw_acquire(t);
+		if (t->hold_us)
+			usleep(t->hold_us);
+		rw_release(t);
+	}
+	return NULL;
+}
+
+int bench_rwlock(int argc, char *argv[])
+{
+	static rw_lock_t l;
+	int readers = 4, writers = 4, seconds = 2, hold_us = 0;
+	int i, n, opt;
+	rw_thread_t *threads, sum;
+	double elapsed;
+
+	l.queued = 1;
+	while ((opt = getopt(argc, argv, "m:r:w:t:h:")) != -1)
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "ticket") == 0)
+				l.queued = 0;
+			else if (strcmp(optarg, "queue") != 0)
+				usage(1);
+			break;
+		case 'r': if (!parse_int(optarg, &readers)) usage(1); break;
+		case 'w': if (!parse_int(optarg, &writers)) usage(1); break;
+		case 't': if (!parse_int(optarg, &seconds)) usage(1); break;
+		case 'h': if (!parse_int(optarg, &hold_us)) usage(1); break;
+		default: usage(1);
+		}
+
+	pthread_mutex_init(&l.mutex, NULL);
+	pthread_cond_init(&l.blockq, NULL);
+	l.tail = &l.head;
+
+	n = readers + writers;
+	threads = calloc(n, sizeof(*threads));
+	elapsed = now();
+	for (i = 0; i < n; i++) {
+		threads[i].l = &l;
+		threads[i].write = i >= readers;
+		threads[i].hold_us = hold_us;
+		pthread_create(&threads[i].thread, NULL, rw_worker, &threads[i]);
+	}
+	sleep(seconds);
+	l.stop = 1;
+	memset(&sum, 0, sizeof(sum));
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i].thread, NULL);
+		sum.acquires += threads[i].acquires;
+		sum.waits += threads[i].waits;
+		sum.wakeups += threads[i].wakeups;
+		sum.useless += threads[i].useless;
+		sum.handoff += threads[i].handoff;
+	}
+	elapsed = now() - elapsed;
+
+	printf("%s: %d readers, %d writers, %d us hold, %.2f s\n",
+	       l.queued ? "queue" : "ticket", readers, writers, hold_us, elapsed);
+	printf("acquires     %12llu (%.0f/s)\n", sum.acquires,
+	       sum.acquires / elapsed);
+	printf("waits        %12llu\n", sum.waits);
+	printf("wakeups      %12llu (%.2f per wait)\n", sum.wakeups,
+	       sum.waits ? (double) sum.wakeups / sum.waits : 0.0);
+	printf("useless      %12llu\n", sum.useless);
+	printf("handoff      %12.1f us average\n",
+	       sum.waits ? sum.handoff / sum.waits * 1e6 : 0.0);
+	free(threads);
+	return 0;
+}
+
+
+/*****************************************************************************/
+/* brlock: read-mostly locking in per-CPU mode                               */
+/*****************************************************************************/
+
+#define BR_SLOTS	64
+
+/* The device lock in per-CPU mode.  Userspace has no synchronize_sched(),
+ * so instead a fast-path reader increments its CPU's count, fences, and
+ * then checks for writers, backing out if there is one; a writer raises
+ * 'writers', fences, and then waits for the counts to drain. */
+typedef struct br_lock {
+	struct {
+		int count;
+		char pad[60];
+	} __attribute__((aligned(64))) slot[BR_SLOTS];	// per-CPU counts
+	int percpu;			// per-CPU (1) or mutex (0) model?
+	int writers;			// 'pcpu_writers'
+	pthread_mutex_t mutex;		// the device 'mutex'
+	pthread_cond_t cond;
+	int num_readers, num_writers, waiting_writers;
+	volatile int stop;
+} br_lock_t;
+
+typedef struct br_thread {
+	pthread_t thread;
+	br_lock_t *l;
+	int write;
+	int interval_us;
+	unsigned long long acquires;
+	unsigned long long slow;	// read locks that took the mutex
+} br_thread_t;
+
+int br_slot(void)
+{
+	int cpu = sched_getcpu();
+	return (cpu < 0 ? 0 : cpu) % BR_SLOTS;
+}
+
+// Like osprd_acquire, readers do not overtake a waiting writer.
+void br_slow_lock(br_lock_t *l, int write)
+{
+	pthread_mutex_lock(&l->mutex);
+	l->waiting_writers += write;
+	while (l->num_writers || (write ? l->num_readers : l->waiting_writers))
+		pthread_cond_wait(&l->cond, &l->mutex);
+	l->waiting_writers -= write;
+	if (write)
+		l->num_writers++;
+	else
+		l->num_readers++;
+	pthread_mutex_unlock(&l->mutex);
+}
+
+void br_slow_unlock(br_lock_t *l, int write)
+{
+	pthread_mutex_lock(&l->mutex);
+	if (write)
+		l->num_writers--;
+	else
+		l->num_readers--;
+	pthread_cond_broadcast(&l->cond);
+	pthread_mutex_unlock(&l->mutex);
+}
+
+int br_readers(br_lock_t *l)
+{
+	int i, n = 0;
+	for (i = 0; i < BR_SLOTS; i++)
+		n += __atomic_load_n(&l->slot[i].count, __ATOMIC_RELAXED);
+	return n;
+}
+
+// Mirrors osprd_lock(); returns the slot used, or -1 for the slow path.
+int br_lock(br_thread_t *t)
+{
+	br_lock_t *l = t->l;
+	int slot;
+
+	if (l->percpu && !t->write) {
+		slot = br_slot();
+		__atomic_fetch_add(&l->slot[slot].count, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&l->writers, __ATOMIC_RELAXED) == 0)
+			return slot;
+		__atomic_fetch_sub(&l->slot[slot].count, 1, __ATOMIC_RELEASE);
+		t->slow++;
+	} else if (l->percpu) {
+		__atomic_fetch_add(&l->writers, 1, __ATOMIC_SEQ_CST);
+		br_slow_lock(l, 1);
+		while (br_readers(l) != 0)
+			sched_yield();
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		return -1;
+	}
+	br_slow_lock(l, t->write);
+	return -1;
+}
+
+// Mirrors osprd_unlock().
+void br_unlock(br_thread_t *t, int slot)
+{
+	br_lock_t *l = t->l;
+
+	if (slot >= 0)
+		__atomic_fetch_sub(&l->slot[slot].count, 1, __ATOMIC_RELEASE);
+	else {
+		br_slow_unlock(l, t->write);
+		if (l->percpu && t->write)
+			__atomic_fetch_sub(&l->writers, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+void *br_worker(void *arg)
+{
+	br_thread_t *t = (br_thread_t *) arg;
+
+	while (!t->l->stop) {
+		br_unlock(t, br_lock(t));
+		t->acquires++;
+		if (t->write && t->interval_us)
+			usleep(t->interval_us);
+	}
+	return NULL;
+}
+
+int bench_brlock(int argc, char *argv[])
+{
+	static br_lock_t l;
+	int readers = 4, writers = 0, seconds = 2, interval_us = 1000;
+	int i, n, opt;
+	br_thread_t *threads;
+	unsigned long long racq = 0, wacq = 0, slow = 0;
+	double elapsed;
+
+	l.percpu = 1;
+	while ((opt = getopt(argc, argv, "m:r:w:i:t:")) != -1)
+		switch (opt) {
+		case 'm':
+			if (strcmp(optarg, "mutex") == 0)
+				l.percpu = 0;
+			else if (strcmp(optarg, "percpu") != 0)
+				usage(1);
+			break;
+		case 'r': if (!parse_int(optarg, &readers)) usage(1); break;
+		case 'w': if (!parse_int(optarg, &writers)) usage(1); break;
+		case 'i': if (!parse_int(optarg, &interval_us)) usage(1); break;
+		case 't': if (!parse_int(optarg, &seconds)) usage(1); break;
+		default: usage(1);
+		}
+
+	pthread_mutex_init(&l.mutex, NULL);
+	pthread_cond_init(&l.cond, NULL);
+
+	n = readers + writers;
+	threads = calloc(n, sizeof(*threads));
+	elapsed = now();
+	for (i = 0; i < n; i++) {
+		threads[i].l = &l;
+		threads[i].write = i >= readers;
+		threads[i].interval_us = interval_us;
+		pthread_create(&threads[i].thread, NULL, br_worker, &threads[i]);
+	}
+	sleep(seconds);
+	l.stop = 1;
+	for (i = 0; i < n; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].write)
+			wacq += threads[i].acquires;
+		else
+			racq += threads[i].acquires;
+		slow += threads[i].slow;
+	}
+	elapsed = now() - elapsed;
+
+	printf("%s: %d readers, %d writers every %d us, %.2f s\n",
+	       l.percpu ? "percpu" : "mutex", readers, writers, interval_us,
+	       elapsed);
+	printf("read locks  %12.0f/s (%.0f/s per reader)\n", racq / elapsed,
+	       readers ? racq / elapsed / readers : 0.0);
+	printf("write locks %12.0f/s\n", wacq / elapsed);
+	if (l.percpu)
+		printf("slow reads  %12llu\n", slow);
+	free(threads);
+	return 0;
+}
+
+
+/*****************************************************************************/
+/* mq: random I/O from many CPUs at once                                     */
+/*****************************************************************************/
+
+typedef struct mq_thread {
+	pthread_t thread;
+	int fd;
+	off_t size;
+	int block;
+	int write_pct;
+	unsigned seed;
+	volatile int *stop;
+	unsigned long long ios;
+} mq_thread_t;
+
+void *mq_worker(void *arg)
+{
+	mq_thread_t *t = (mq_thread_t *) arg;
+	void *buf;
+
+	if (posix_memalign(&buf, 4096, t->block) != 0) {
+		perror("posix_memalign");
+		exit(1);
+	}
+	memset(buf, 0x5a, t->block);
+	while (!*t->stop) {
+		off_t pos = (off_t) (next_random(&t->seed)
+				     % (t->size / t->block)) * t->block;
+		int write = (int) (next_random(&t->seed) % 100) < t->write_pct;
+		ssize_t r = write ? pwrite(t->fd, buf, t->block, pos)
+			: pread(t->fd, buf, t->block, pos);
+		if (r != t->block) {
+			perror(write ? "write" : "read");
+			exit(1);
+		}
+		t->ios++;
+	}
+	free(buf);
+	return NULL;
+}
+
+int bench_mq(int argc, char *argv[])
+{
+	const char *devname = "/dev/osprda";
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN), write_pct = 0;
+	int block = 4096, seconds = 2, n, i, opt, fd;
+	volatile int stop;
+	mq_thread_t *threads;
+	unsigned long long ios;
+	double start, elapsed, iops, base = 0;
+	off_t size;
+
+	while ((opt = getopt(argc, argv, "j:w:b:t:")) != -1)
+		switch (opt) {
+		case 'j': if (!parse_int(optarg, &nthreads) || !nthreads) usage(1); break;
+		case 'w': if (!parse_int(optarg, &write_pct) || write_pct > 100) usage(1); break;
+		case 'b': if (!parse_int(optarg, &block) || block % 512 || !block) usage(1); break;
+		case 't': if (!parse_int(optarg, &seconds)) usage(1); break;
+		default: usage(1);
+		}
+	if (optind < argc)
+		devname = argv[optind];
+
+	fd = open_device(devname, write_pct ? O_RDWR : O_RDONLY, 0, &size);
+	if (block > size)
+		block = size;
+	threads = calloc(nthreads, sizeof(*threads));
+
+	printf("%s, %d-byte random I/O, %d%% writes\n", devname, block,
+	       write_pct);
+	for (n = 1; ; n = n * 2 > nthreads && n < nthreads ? nthreads : n * 2) {
+		stop = 0;
+		start = now();
+		for (i = 0; i < n; i++) {
+			threads[i].fd = fd;
+			threads[i].size = size;
+			threads[i].block = block;
+			threads[i].write_pct = write_pct;
+			threads[i].seed = i + 1;
+			threads[i].stop = &stop;
+			threads[i].ios = 0;
+			pthread_create(&threads[i].thread, NULL, mq_worker,
+				       &threads[i]);
+		}
+		sleep(seconds);
+		stop = 1;
+		for (i = ios = 0; i < n; i++) {
+			pthread_join(threads[i].thread, NULL);
+			ios += threads[i].ios;
+		}
+		elapsed = now() - start;
+		iops = ios / elapsed;
+		if (n == 1)
+			base = iops;
+		printf("%4d threads %12.0f IOPS (%.0f per thread), x%.2f\n",
+		       n, iops, iops / n, base ? iops / base : 0.0);
+		if (n >= nthreads)
+			break;
+	}
+	close(fd);
+	free(threads);
+	return 0;
+}
+
+
+struct benchmark {
+	const char *name;
+	int (*run)(int argc, char *argv[]);
+};
+
+static struct benchmark benchmarks[] = {
+	{ "sim", bench_sim },
+	{ "seq", bench_seq },
+	{ "small", bench_small },
+	{ "crc", bench_crc },
+	{ "rwlock", bench_rwlock },
+	{ "brlock", bench_brlock },
+	{ "mq", bench_mq },
+	{ NULL, NULL }
+};
+
+int main(int argc, char *argv[])
+{
+	struct benchmark *b;
+
+	if (argc < 2 || strcmp(argv[1], "-h") == 0
+	    || strcmp(argv[1], "--help") == 0)
+		usage(argc < 2);
+	for (b = benchmarks; b->name; b++)
+		if (strcmp(argv[1], b->name) == 0)
+			return b->run(argc - 1, argv + 1);
+	usage(1);
+	return 1;
+}